@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef ARRIVAL_H
+#define ARRIVAL_H
+
+#include "common.h"
+
+/* A process to load, as a line of the config file describes it */
+struct arrival_t {
+    uint64_t start_time;    // First slot it may arrive in
+    std::string path;
+    uint32_t prio;
+    uint64_t deadline;    // Relative to its arrival, 0 if none
+};
+
+/* Random values of one kind: fixed:N, uniform:MIN:MAX (inclusive) or
+ * exp:MEAN, rounded down */
+struct distribution_t {
+    enum { FIXED, UNIFORM, EXP } kind{FIXED};
+    double a{};
+    double b{};
+
+    /* Parse [value] of option [key], exit if it is not a distribution */
+    static distribution_t parse(const char *key, const char *value);
+
+    uint64_t sample(std::mt19937_64 &rng) const;
+};
+
+/* Workload generated in place of the process lines of a config file */
+struct workload_spec_t {
+    distribution_t gaps{distribution_t::FIXED, 1, 0};    // Slots between two arrivals
+    distribution_t prios;
+    distribution_t deadlines;
+    std::vector<std::pair<std::string, double>> images;    // Files of input/proc and their weights
+    uint64_t seed{1};
+
+    /* Apply option [key]=[value]: arrivals, prios or deadlines followed
+     * by a distribution, images followed by a comma separated list of
+     * NAME or NAME:WEIGHT, seed. Return 0 if [key] is a workload option,
+     * 1 otherwise. Exit on an invalid value */
+    int set(const char *key, const char *value);
+};
+
+/* Processes in the order they arrive, produced as they are asked for */
+class arrival_source_t {
+public:
+    virtual ~arrival_source_t() = default;
+
+    /* Fill [arrival] with the next process, false once there is none left */
+    virtual bool next(arrival_t &arrival) = 0;
+};
+
+/* The [count] process lines following the first line of [file], the
+ * config file at [path]. The source closes [file] */
+std::unique_ptr<arrival_source_t> config_arrivals(FILE *file, const char *path, uint64_t count);
+
+/* [count] processes drawn from [spec] */
+std::unique_ptr<arrival_source_t> generated_arrivals(const workload_spec_t &spec, uint64_t count);
+
+#endif
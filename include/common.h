@@ -15,9 +15,8 @@
 #include <mutex>
 #include <bits/stdc++.h>
 
-#define MLQ_SCHED
-#define OPTIMIZED_SCH
-
+/* Default address space geometry. memory_t can be configured with another
+ * one at startup, see mem_config_t */
 #define ADDRESS_SIZE    20
 #define OFFSET_LEN    10
 #define FIRST_LV_LEN    5
@@ -29,14 +28,17 @@
 #define PAGE_SIZE    (1 << OFFSET_LEN)
 
 typedef char BYTE;
-typedef uint32_t addr_t;
+typedef uint64_t addr_t;
 
 enum ins_opcode_t {
     CALC,    // Just perform calculation, only use CPU
     ALLOC,    // Allocate memory
     FREE,    // Deallocated a memory block
     READ,    // Write data to a byte on memory
-    WRITE    // Read data from a byte on memory
+    WRITE,    // Read data from a byte on memory
+    FILL,    // Set every byte of a memory range to the same value
+    COPY,    // Copy a memory range to another one
+    FORK    // Duplicate the process, sharing its memory copy-on-write
 };
 
 /* instructions executed by the CPU */
@@ -47,50 +49,147 @@ struct inst_t {
     uint32_t arg_2;
 };
 
-struct code_seg_t {
-    std::vector<inst_t> text;
+/* Code segment pre-decoded by the threaded CPU engine, see cpu.cpp */
+struct decoded_code_t;
+
+/* Instructions of a code segment, read only once built, either held in
+ * memory or mapped from a compiled process image (see load()). Copies
+ * share them and their decoded form, so do processes loaded from the
+ * same file */
+class code_text_t {
+private:
+    /* Shared by every copy */
+    struct shared_t {
+        std::shared_ptr<const void> owner;    // The vector or the mapping holding the instructions
+        std::once_flag decode_once;
+        std::shared_ptr<const decoded_code_t> decoded;    // Set under decode_once
+    };
+
+    std::shared_ptr<shared_t> _shared;
+    const inst_t *_data{};
+    size_t _size{};
+
+public:
+    code_text_t() = default;
+
+    /* Freeze [text], filled by a loader */
+    explicit code_text_t(std::vector<inst_t> text) : _shared(std::make_shared<shared_t>()) {
+        auto owner = std::make_shared<const std::vector<inst_t>>(std::move(text));
+        _data = owner->data();
+        _size = owner->size();
+        _shared->owner = std::move(owner);
+    }
 
-    explicit code_seg_t(int code_size) : text(code_size) {}
-};
+    /* [size] instructions at [data], which stay valid as long as [owner] */
+    code_text_t(const std::shared_ptr<const void> &owner, const inst_t *data, size_t size)
+        : _shared(std::make_shared<shared_t>()), _data(data), _size(size) {
+        _shared->owner = owner;
+    }
+
+    size_t size() const { return _size; }
+
+    const inst_t &operator[](size_t index) const { return _data[index]; }
+
+    const inst_t *begin() const { return _data; }
 
-/* Second layer */
-struct trans_table_entry_t {
-    addr_t v_index; // The index of virtual address
-    addr_t p_index; // The index of physical address
+    const inst_t *end() const { return _data + _size; }
+
+    /* Decoded form of the instructions, made by [decode] on the first call
+     * of any copy. Not for a default constructed text */
+    template<typename decode_t>
+    const decoded_code_t *decoded(decode_t decode) const {
+        std::call_once(_shared->decode_once, [&]() { _shared->decoded = decode(*this); });
+        return _shared->decoded.get();
+    }
 };
 
-struct trans_table_t {
-    /* A row in the page table of the second layer */
-    trans_table_entry_t table[1 << SECOND_LV_LEN];
-    int size;
+struct code_seg_t {
+    code_text_t text;
+
+    code_seg_t() = default;
+
+    explicit code_seg_t(code_text_t text) : text(std::move(text)) {}
 };
 
-/* Mapping virtual addresses and physical ones */
+#define PTE_VALID   0x1 // The entry maps a page or points to a table
+#define PTE_PRESENT 0x2 // The page is in RAM, [p_index] is its frame
+#define PTE_SWAPPED 0x4 // The page is in swap, [p_index] is its slot
+#define PTE_LAST    0x8 // Last page of an allocated region
+#define PTE_COW     0x10 // The frame is shared with a forked process, copy it before writing
+
+/* An entry of any level of a page table. Above the last level, [p_index] is
+ * the arena offset of the next level table and [size] counts the entries in
+ * use there. In the last level, [p_index] is the physical page or the swap
+ * slot, depending on [flags] */
 struct page_table_entry_t {
-    addr_t v_index{};    // Virtual index
-    std::shared_ptr<trans_table_t> pages{};
+    uint32_t flags;
+    uint32_t size;
+    addr_t p_index;
 };
 
 struct page_table_t {
-    /* Translation table for the first layer */
-    std::vector<page_table_entry_t> table;
+    /* Tables of every level of this process live side by side here and are
+     * referenced by offset, so they all go away with the process. The root
+     * table is at offset 0 once anything has been mapped */
+    std::vector<page_table_entry_t> arena;
+    std::vector<std::vector<addr_t>> free_tables;    // Offsets released by free_mem, per level
+
+    /* Take an empty table of [entries] entries for [level] and return its offset */
+    addr_t new_table(uint32_t level, uint32_t entries) {
+        if (level < free_tables.size() && !free_tables[level].empty()) {
+            addr_t offset = free_tables[level].back();
+            free_tables[level].pop_back();
+            std::fill_n(arena.begin() + (long) offset, entries, page_table_entry_t{});
+            return offset;
+        }
+        addr_t offset = arena.size();
+        arena.resize(arena.size() + entries);
+        return offset;
+    }
 
-    page_table_t() : table(1 << FIRST_LV_LEN) {}
+    /* Give the table at [offset] of [level] back to the arena */
+    void release_table(uint32_t level, addr_t offset) {
+        if (level >= free_tables.size()) {
+            free_tables.resize(level + 1);
+        }
+        free_tables[level].push_back(offset);
+    }
 };
 
 /* PCB, describe information about a process */
 struct pcb_t {
     uint32_t pid;    // PID
     uint32_t priority; /* Task with higher priority runs first */
+    /* Links of the ready queue_t holding the process, which owns it through
+     * [self] meanwhile. A process is in one queue_t at most. Kept next to
+     * [priority], which the queue compares */
+    struct {
+        pcb_t *child;
+        pcb_t *sibling;
+        uint64_t seq;    // Enqueue order, ties on priority go first in first out
+        std::shared_ptr<pcb_t> self;
+    } ready{};
     code_seg_t code;    // Code segment
     addr_t regs[10]{}; // Registers, store address of allocated regions
     uint32_t pc{}; // Program pointer, point to the next instruction
     page_table_t seg_table; // Page table
-    uint32_t bp{PAGE_SIZE};    // Break pointer
+    addr_t bp{};    // Break pointer, 0 until the first allocation
     uint32_t prio{};
+    /* Bookkeeping of the scheduling policies and of the statistics os
+     * prints, in time slots */
+    struct {
+        uint64_t vruntime;    // Virtual runtime (cfs) or pass (stride)
+        uint64_t deadline;    // Absolute deadline (edf), relative one until the process is admitted
+        uint64_t arrival;    // Slot the process first became ready
+        uint64_t first_run;    // Slot it was first dispatched, if [started]
+        uint64_t ran;    // Slots it has run
+        bool started;
+    } sched{};
+    std::atomic<uint32_t> tlb_gen{}; // Bumped whenever a mapping of this process goes away
+    std::mutex mm_lock; // Guards seg_table and bp
 
     /* Constructor for initialization */
-    pcb_t(uint32_t pid, uint32_t priority, int code_size) : code(code_size) {
+    pcb_t(uint32_t pid, uint32_t priority) {
         this->pid = pid;
         this->priority = priority;
     }
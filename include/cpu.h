@@ -10,5 +10,21 @@
  * Otherwise, return 1. */
 int run(struct pcb_t * proc);
 
+enum cpu_engine_t {
+    ENGINE_SWITCH,    // run() once per instruction
+    ENGINE_THREADED    // Pre-decoded code with computed goto dispatch, CALC runs fused
+};
+
+/* Execute up to [budget] instructions of [proc] with [engine], stopping
+ * early at the end of its code. Return the number of instructions
+ * executed */
+uint32_t run_slice(struct pcb_t * proc, uint32_t budget, cpu_engine_t engine);
+
+/* Called with every process created by FORK, which fails while no
+ * handler is set */
+typedef void (*spawn_handler_t)(std::shared_ptr<pcb_t> child);
+
+void set_spawn_handler(spawn_handler_t handler);
+
 #endif
 
@@ -5,7 +5,37 @@
 
 #include "common.h"
 
+#define IMAGE_MAGIC "OSIMAGE1"
+
+/* Header of a compiled process image, see save_image(). The instructions
+ * follow as inst_t are laid out in memory, so load() maps them as is */
+struct image_header_t {
+    char magic[sizeof(IMAGE_MAGIC) - 1];
+    uint32_t priority;
+    uint32_t code_size;
+    uint64_t checksum;    // image_checksum() of the instructions
+    uint64_t reserved;
+};
+
+/* Load the process at [path], a text descriptor or a compiled image.
+ * Processes loaded from the same file share their instructions */
 std::shared_ptr<pcb_t> load(const char * path);
 
-#endif
+/* Same with PID [pid], so that processes loaded ahead of time can be
+ * numbered in arrival order */
+std::shared_ptr<pcb_t> load(const char *path, uint32_t pid);
+
+/* Loads that shared the code segment of an earlier one of the same
+ * unchanged file instead of reading it */
+uint64_t cached_loads();
 
+/* Save [code] and [priority] as a compiled process image at [path] */
+void save_image(const char *path, const code_seg_t &code, uint32_t priority);
+
+/* Checksum stored in the image header of [code] */
+uint64_t image_checksum(const code_text_t &code);
+
+/* Reserve a PID for a new process */
+uint32_t new_pid();
+
+#endif
@@ -4,38 +4,252 @@
 #define MEM_H
 
 #include "common.h"
+#include "metrics.h"
 
 #define RAM_SIZE    (1 << ADDRESS_SIZE)
+#define TLB_SIZE    64
+#define FAULT_RETRIES   10000
+#define MAX_LEVELS  6
+#define INVALID_ADDR    (~(addr_t) 0)
+
+/* Shape and behaviour of the simulated memory. Sizes are powers of two
+ * given in bits */
+struct mem_config_t {
+    uint32_t address_size{ADDRESS_SIZE};    // Virtual address space of a process
+    uint32_t ram_size{ADDRESS_SIZE};    // Physical memory
+    uint32_t offset_len{OFFSET_LEN};    // Page
+    uint32_t levels{2};    // Number of page table levels
+    bool reclaim{false};    // Hand the RAM of freed pages back to the host
+    bool demand{false};    // Give pages a frame on first access, swapping others out if needed
+    std::string swap{"mem"};    // Swap device: "mem" or the path of a file
+    std::string evict{"clock"};    // Page replacement policy: fifo, clock or lru
+
+    /* Apply option [key]=[value]: vspace, ram or page followed by a size
+     * such as 4K or 16G, levels followed by a count, reclaim followed
+     * by 0 or 1, paging followed by eager or demand, swap or evict.
+     * Return 0 if [key] is a memory option, 1 otherwise. Exit on an
+     * invalid value */
+    int set(const char *key, const char *value);
+};
+
+/* A cached translation. Entries are tagged with the owner PID (used as an
+ * address space id, PID 0 never exists) and the owner's [tlb_gen] at fill
+ * time, so a process moving between CPUs never needs a remote shootdown */
+struct tlb_entry_t {
+    uint32_t pid;
+    uint32_t gen;
+    addr_t v_page;
+    addr_t p_page;
+    bool writable;    // False for copy-on-write pages, writes take the slow path
+};
+
+/* Direct-mapped translation cache owned by a single CPU thread */
+struct tlb_t {
+    tlb_entry_t entries[TLB_SIZE]{};
+    uint64_t hits{};
+    uint64_t misses{};
+
+    /* Drop every cached translation */
+    void flush();
+};
 
 struct mem_stat_t {
-    uint32_t proc;  // ID of process currently uses this page
+    uint32_t proc;  // ID of process which allocated this page
     uint32_t index;    // Index of the page in the list of pages allocated to the process.
     long next;    // The next page in the list. -1 if it is the last page.
+    uint32_t refs;    // Page table entries mapping the frame, 0 if it is free
+    /* Reverse mapping, used to take the frame back from its owner.
+     * Shared frames have no single owner and are never evicted */
+    pcb_t *owner;
+    addr_t v_page;
+    uint32_t stamp;    // Bumped every time the frame gets a new page
+    uint8_t referenced;    // Set on access, cleared by the replacement policy
+    uint8_t age;    // Access history kept by the lru policy
+};
+
+/* Decides which resident page leaves RAM when demand paging runs out of
+ * frames. Policies only order the frames, memory_t does the eviction */
+class page_policy_t {
+public:
+    virtual ~page_policy_t() = default;
+
+    /* [frame] has just been given a page */
+    virtual void mapped(addr_t frame) = 0;
+
+    /* Offer frames to [evict] in the order they should go until it takes
+     * one. Return that frame, or -1 if every frame was refused */
+    virtual long victim(const std::function<bool(addr_t)> &evict) = 0;
+};
+
+/* Policy called [name] over the frames described by [stat] */
+std::unique_ptr<page_policy_t> make_page_policy(const std::string &name,
+                                                mem_stat_t *stat, addr_t num_frames);
+
+/* Backing store for pages pushed out of RAM, one page per slot. Kept in
+ * memory, or in a file when given a path */
+class swap_device_t {
+private:
+    int _fd{-1};
+    size_t _page_size{};
+    std::vector<BYTE> _store;
+    std::vector<long> _free_slots;
+    long _slots{};
+
+public:
+    swap_device_t() = default;
+
+    swap_device_t(const std::string &path, size_t page_size);
+
+    ~swap_device_t();
+
+    swap_device_t &operator=(swap_device_t &&other) noexcept;
+
+    /* Save a page and return its slot */
+    long store(const BYTE *page);
+
+    /* Copy the page saved in [slot] to [page] and release the slot */
+    void load(long slot, BYTE *page);
+
+    /* Drop the page saved in [slot] */
+    void release(long slot);
+};
+
+/* Paging activity since the memory was configured */
+struct paging_stat_t {
+    uint64_t faults;
+    uint64_t swap_ins;
+    uint64_t swap_outs;
+};
+
+/* Two-level bitmap of free physical frames. A set bit in [_words] marks a
+ * free frame, a set bit in [_summary] marks a word still having free frames.
+ * Frames are always handed out lowest index first, as the linear scan did */
+class frame_bitmap_t {
+private:
+    std::vector<uint64_t> _words;
+    std::vector<uint64_t> _summary;
+    addr_t _free;
+    addr_t _low; // No summary word below this one has a set bit
+
+public:
+    explicit frame_bitmap_t(addr_t num_frames);
+
+    /* Number of free frames */
+    addr_t available() const { return _free; }
+
+    /* Take the lowest free frame. Return -1 if every frame is in use */
+    long take();
+
+    /* Give [frame] back */
+    void release(addr_t frame);
 };
 
 class memory_t {
 private:
-    std::mutex m_Lock;
-    std::vector<mem_stat_t> _mem_stat;
-    std::vector<BYTE> _ram;
+    std::mutex m_Lock;    // Guards _mem_stat and _frames. Page tables have their own lock
+
+    mem_config_t _cfg;
+    uint32_t _level_len[MAX_LEVELS];    // Index bits of each page table level, root first
+    uint32_t _level_shift[MAX_LEVELS];    // Position of those bits in a virtual address
+
+    /* Both are anonymous mappings reserved without swap space, the host
+     * only commits the pages which are touched */
+    mem_stat_t *_mem_stat{};
+    frame_bitmap_t _frames;
+    BYTE *_ram{};
+
+    /* Demand paging, guarded by m_Lock */
+    std::unique_ptr<page_policy_t> _policy;
+    swap_device_t _swap;
+    paging_stat_t _paging{};
+
+    hdr_histogram_t _alloc_ns;    // Time alloc_mem took
+    std::atomic<uint64_t> _alloc_failures{};
+
+    /* alloc_mem() without the metrics */
+    addr_t alloc_region(uint32_t size, pcb_t *proc);
 
     /* get offset of the virtual address */
-    static addr_t get_offset(addr_t addr);
+    addr_t get_offset(addr_t addr) const;
 
-    /* get the first layer index */
-    static addr_t get_first_lv(addr_t addr);
+    /* get the index into the page table of [level] */
+    addr_t get_index(addr_t addr, uint32_t level) const;
 
-    /* get the second layer index */
-    static addr_t get_second_lv(addr_t addr);
+    /* Last level entry of [virtual_addr], nullptr if it was never
+     * allocated. The page may be swapped out or not loaded yet */
+    page_table_entry_t *walk(addr_t virtual_addr, pcb_t *proc) const;
 
-    /* Translate virtual address to physical address. If [virtual_addr] is valid,
-     * return 1 and write its physical counterpart to [physical_addr].
-     * Otherwise, return 0 */
-    static addr_t translate(addr_t virtual_addr,      // Given virtual address
-                     pcb_t *proc);             // Process uses given virtual address
+    /* Last level entry for [virtual_addr], creating the tables on the way */
+    page_table_entry_t &map(addr_t virtual_addr, pcb_t *proc) const;
+
+    /* Clear the last level entry of [virtual_addr] and release the tables
+     * left empty */
+    void unmap(addr_t virtual_addr, pcb_t *proc) const;
+
+    /* Same as translate() but served from the TLB of the calling thread,
+     * if it has one, and loading the page if it is not resident. The page
+     * table lock of [proc] is taken for the walk unless [mm_lock] already
+     * holds it. A [write] lookup unshares copy-on-write pages */
+    addr_t lookup(addr_t virtual_addr, pcb_t *proc, std::unique_lock<std::mutex> &mm_lock,
+                  bool write = false);
+
+    /* Lock the page table of [proc] when pages can be taken away under it
+     * by another CPU, which only happens with demand paging */
+    std::unique_lock<std::mutex> pin(pcb_t *proc) const;
+
+    /* Give the allocated but non-resident page at [virtual_addr] a frame,
+     * loading it back from swap if it was there. The caller holds the page
+     * table lock of [proc]. Return the physical address or INVALID_ADDR */
+    addr_t fault(addr_t virtual_addr, pcb_t *proc);
+
+    /* Take a free frame, or one from another page which then goes to swap.
+     * [proc] is the faulting process, whose lock is held. Return -1 if
+     * nothing could be evicted. The caller holds m_Lock */
+    long get_frame(pcb_t *proc);
+
+    /* Unmap the pages of [proc] from [address] on, up to the end of its
+     * region when [region] is set, up to the break pointer otherwise, and
+     * give their frames and swap slots back. The caller holds the page
+     * table lock of [proc] */
+    void drop(addr_t address, pcb_t *proc, bool region);
+
+    /* Take a free frame, evicting a page in demand paging mode, until
+     * FAULT_RETRIES attempts failed. [lock] holds m_Lock */
+    long take_frame(pcb_t *proc, std::unique_lock<std::mutex> &lock);
+
+    /* Give the copy-on-write page at [virtual_addr] a private frame, or
+     * just keep it if no other process maps it anymore. The caller holds
+     * the page table lock of [proc]. Return the physical address or
+     * INVALID_ADDR */
+    addr_t unshare(addr_t virtual_addr, pcb_t *proc);
+
+    /* Record that [frame] now holds [v_page] of [proc]. The caller holds m_Lock */
+    void set_owner(addr_t frame, pcb_t *proc, addr_t v_page, addr_t index, long next);
+
+    /* Call [op] on every physically contiguous span of [size] bytes starting
+     * at [address], translating once per page. Return 1 as soon as a page
+     * is not mapped, 0 if the whole range was visited */
+    template<typename span_op_t>
+    int for_each_span(addr_t address, pcb_t *proc, uint32_t size, bool write, span_op_t op);
 
 public:
-    memory_t() : _mem_stat(NUM_PAGES), _ram(RAM_SIZE) {}
+    /* Translate virtual address to physical address. If [virtual_addr] is valid,
+     * return its physical counterpart. Otherwise, return INVALID_ADDR */
+    addr_t translate(addr_t virtual_addr,      // Given virtual address
+                     pcb_t *proc) const;       // Process uses given virtual address
+
+    memory_t();
+
+    ~memory_t();
+
+    /* Switch to [cfg]. Must be done before the first allocation */
+    void configure(const mem_config_t &cfg);
+
+    const mem_config_t &config() const { return _cfg; }
+
+    addr_t page_size() const { return (addr_t) 1 << _cfg.offset_len; }
+
+    addr_t num_pages() const { return (addr_t) 1 << (_cfg.ram_size - _cfg.offset_len); }
 
     /* Allocate [size] bytes for process [proc] and return its virtual address.
      * If we cannot allocate new memory region for this process, return 0 */
@@ -54,7 +268,47 @@ public:
      * [proc]. If given [address] is valid, return 0. Otherwise, return 1 */
     int write_mem(addr_t address, pcb_t *proc, BYTE data);
 
+    /* Block counterparts of read_mem and write_mem. They move [size] bytes
+     * between the memory at [address] of process [proc] and [data].
+     * Return 0 if the whole range is valid. Otherwise, return 1 and only
+     * the bytes in front of the first invalid page are moved */
+    int read_block(addr_t address, pcb_t *proc, BYTE *data, uint32_t size);
+
+    int write_block(addr_t address, pcb_t *proc, const BYTE *data, uint32_t size);
+
+    /* Set [size] bytes starting at [address] of process [proc] to [data].
+     * Same return value as write_block */
+    int fill(addr_t address, pcb_t *proc, BYTE data, uint32_t size);
+
+    /* Copy [size] bytes from [source] to [destination], both used by
+     * process [proc]. Overlapping ranges are allowed. Return 0 if both
+     * ranges are valid. Otherwise, return 1 */
+    int copy(addr_t destination, addr_t source, pcb_t *proc, uint32_t size);
+
+    /* Free every region of [proc]. Must be called before a process whose
+     * memory may still be allocated is destroyed */
+    void release(pcb_t *proc);
+
+    /* Give [child], a new process, the address space of [parent]. Resident
+     * pages are shared copy-on-write, swapped pages are copied */
+    void fork(pcb_t *parent, pcb_t *child);
+
     void dump();
+
+    paging_stat_t paging_stat();
+
+    /* Nanoseconds taken by every alloc_mem() call */
+    const hdr_histogram_t &alloc_latency() const { return _alloc_ns; }
+
+    /* alloc_mem() calls which returned 0 */
+    uint64_t alloc_failures() const { return _alloc_failures.load(std::memory_order_relaxed); }
+
+    /* Number of frames mapped by at least one process */
+    addr_t used_frames();
+
+    /* Use [tlb] for the translations made by the calling thread. Pass
+     * nullptr to walk the page table every time */
+    static void attach_tlb(tlb_t *tlb);
 };
 
 
@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+#define HDR_SUB_BITS 5    // 32 linear buckets per power of two, about 3% precision
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS ((64 - HDR_SUB_BITS + 1) * HDR_SUB_COUNT)
+
+/* Histogram of 64-bit values in the HDR layout: values below HDR_SUB_COUNT
+ * have a bucket each, above that every power of two is split into
+ * HDR_SUB_COUNT buckets of equal width. Any thread may record */
+class hdr_histogram_t {
+private:
+    std::atomic<uint64_t> _counts[HDR_BUCKETS]{};
+    std::atomic<uint64_t> _count{};
+    std::atomic<uint64_t> _sum{};
+    std::atomic<uint64_t> _min{UINT64_MAX};
+    std::atomic<uint64_t> _max{};
+
+    static uint32_t bucket(uint64_t value) {
+        if (value < HDR_SUB_COUNT) {
+            return value;
+        }
+        uint32_t exponent = 63 - __builtin_clzll(value);
+        uint32_t shift = exponent - HDR_SUB_BITS;
+        return (shift + 1) * HDR_SUB_COUNT + (uint32_t) (value >> shift) - HDR_SUB_COUNT;
+    }
+
+    /* Largest value falling in [bucket] */
+    static uint64_t highest(uint32_t bucket);
+
+public:
+    void record(uint64_t value) {
+        _counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t min = _min.load(std::memory_order_relaxed);
+        while (value < min && !_min.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+        }
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+    uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+
+    uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+
+    double mean() const { return count() ? (double) sum() / count() : 0.0; }
+
+    /* Smallest recorded value at or above [quantile] (0..1) of the others,
+     * up to the bucket precision */
+    uint64_t percentile(double quantile) const;
+
+    /* Count, min, mean, max and the usual percentiles as a JSON object */
+    void json(FILE *out) const;
+};
+
+/* Lock [mutex], recording in [waits] how many nanoseconds it took when
+ * another thread held it */
+inline std::unique_lock<std::mutex> metered_lock(std::mutex &mutex, hdr_histogram_t &waits) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto begin = std::chrono::steady_clock::now();
+        lock.lock();
+        waits.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count());
+    }
+    return lock;
+}
+
+#endif
@@ -5,24 +5,36 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
+/* Ready queue, highest [priority] first and first in first out among equal
+ * priorities. An intrusive pairing heap: the links live in pcb_t::ready, so
+ * there is no size limit and enqueue/dequeue never allocate. Enqueue is
+ * O(1), dequeue O(log n) amortized */
+class queue_t {
+private:
+    pcb_t *_root{};
+    size_t _size{};
+    uint64_t _seq{};
 
-/* Define necessary methods to compare the priority between processes */
-class pcb_comparator {
-public:
-    bool operator()(std::shared_ptr<pcb_t> const &a, std::shared_ptr<pcb_t> const &b) {
-        return (a->priority < b->priority);
+    /* True if [a] must run before [b] */
+    static bool before(const pcb_t *a, const pcb_t *b) {
+        return a->priority > b->priority || (a->priority == b->priority && a->ready.seq < b->ready.seq);
     }
-};
 
-class queue_t {
-private:
-    /* Priority queue is based on a max_heap */
-    /*
-     * HOW THAT WORK: https://he-s3.s3.amazonaws.com/media/uploads/31ddacf.jpg
-     */
-    std::priority_queue<std::shared_ptr<pcb_t>, std::vector<std::shared_ptr<pcb_t>>, pcb_comparator> q;
+    /* Link two heaps, return the new root */
+    static pcb_t *meld(pcb_t *a, pcb_t *b);
+
+    /* Heap made of the children of a removed root */
+    static pcb_t *merge_pairs(pcb_t *first);
+
 public:
+    queue_t() = default;
+
+    queue_t(queue_t &&other) noexcept;
+
+    queue_t &operator=(queue_t &&other) noexcept;
+
+    ~queue_t();
+
     /* Add new process to queue */
     void enqueue(std::shared_ptr<pcb_t> proc);
 
@@ -30,7 +42,39 @@ public:
     std::shared_ptr<pcb_t> dequeue();
 
     /* Check if queue is empty */
-    bool empty();
+    bool empty() const { return _root == nullptr; }
+
+    size_t size() const { return _size; }
+};
+
+/* Bounded FIFO of processes shared by many producers and consumers without
+ * a lock (D. Vyukov's array queue). The sequence number of a cell tells
+ * whether it waits for the producer or for the consumer of the current lap */
+class mpmc_queue_t {
+private:
+    struct cell_t {
+        std::atomic<size_t> seq;
+        std::shared_ptr<pcb_t> proc;
+    };
+
+    std::unique_ptr<cell_t[]> _cells;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head{};    // Next cell to dequeue
+    alignas(64) std::atomic<size_t> _tail{};    // Next cell to enqueue
+
+public:
+    /* [capacity] must be a power of two */
+    explicit mpmc_queue_t(size_t capacity);
+
+    /* Return false if the queue is full */
+    bool try_enqueue(const std::shared_ptr<pcb_t> &proc);
+
+    /* Return nullptr if the queue is empty */
+    std::shared_ptr<pcb_t> try_dequeue();
+
+    /* True if no process was enqueued and not dequeued yet. An enqueue in
+     * progress already counts */
+    bool empty() const;
 };
 
 #endif
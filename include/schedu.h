@@ -4,41 +4,236 @@
 #define SCHEDULER_H
 
 #include "queue.h"
+#include "metrics.h"
 
 #define MAX_PRIO 512
+#define LEVEL_CAPACITY 1024
+#define SCHED_SCALE (1 << 20)    // Fixed point unit of virtual runtimes and passes
 
-#ifdef MLQ_SCHED
-class mlq_scheduler_t {
+/* Set of priority levels with O(1) insert, erase and lowest-level lookup:
+ * one bit per level, plus a summary bit per word telling which words are
+ * not zero */
+class prio_bitmap_t {
 private:
-    queue_t m_q_Ready[MAX_PRIO];
-#ifdef OPTIMIZED_SCH
-    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<>> m_q_Access;
-#endif
+    uint64_t _words[MAX_PRIO / 64]{};
+    uint64_t _summary{};
+
+public:
+    void set(uint32_t prio) {
+        _words[prio / 64] |= 1ULL << (prio % 64);
+        _summary |= 1ULL << (prio / 64);
+    }
+
+    void clear(uint32_t prio) {
+        _words[prio / 64] &= ~(1ULL << (prio % 64));
+        if (_words[prio / 64] == 0) {
+            _summary &= ~(1ULL << (prio / 64));
+        }
+    }
+
+    /* Lowest level in the set, MAX_PRIO if it is empty */
+    uint32_t first() const {
+        if (_summary == 0) {
+            return MAX_PRIO;
+        }
+        uint32_t word = std::countr_zero(_summary);
+        return word * 64 + std::countr_zero(_words[word]);
+    }
+};
+
+/* Ready queue of a scheduling policy. [add_proc] queues a process that
+ * becomes ready, [put_proc] one preempted after running a whole time slice.
+ * Policies are picked at runtime by name, see make_policy() */
+class sched_policy_t {
+public:
+    virtual ~sched_policy_t() = default;
+
+    /* Extract the next process to run, nullptr if none is ready */
+    virtual std::shared_ptr<pcb_t> get_proc() = 0;
+
+    /* Add a new process */
+    virtual void add_proc(const std::shared_ptr<pcb_t> &proc) = 0;
+
+    /* Add back a process that used up its time slice */
+    virtual void put_proc(const std::shared_ptr<pcb_t> &proc) { add_proc(proc); }
+};
+
+/* Nanoseconds CPUs waited for the lock of a scheduler held by another one */
+hdr_histogram_t &sched_lock_waits();
+
+/* Policy named [name]: mlq, lockfree, twoqueue, cfs, lottery, stride or
+ * edf. nullptr if there is no such policy */
+std::unique_ptr<sched_policy_t> make_policy(const std::string &name);
+
+/* One ready queue per prio level, the lowest prio always runs first */
+class mlq_scheduler_t final : public sched_policy_t {
+private:
+    queue_t m_q_Ready[MAX_PRIO];    // By prio
+    prio_bitmap_t m_Levels;    // Levels holding processes
     std::mutex m_Lock;
 public:
     /* Extract processes from the priority queue */
-    std::shared_ptr<pcb_t> get_proc();
+    std::shared_ptr<pcb_t> get_proc() override;
 
     /* Add process to MLQ scheduler */
-    void add_proc(const std::shared_ptr<pcb_t> &proc);
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
 };
-#else
-class scheduler_t {
+
+/* A level of lockfree_mlq_scheduler_t. Processes added while the ring is
+ * full, or while earlier ones are still spilled, go to a locked list the
+ * CPUs drain once the ring is empty. add_proc must not wait for the CPUs:
+ * arrivals are admitted while every CPU waits at the timer barrier */
+struct lockfree_level_t {
+    mpmc_queue_t ring{LEVEL_CAPACITY};
+    std::atomic<size_t> spilled{};    // Size of [spill]
+    std::mutex spill_lock;
+    std::deque<std::shared_ptr<pcb_t>> spill;    // Guarded by spill_lock
+
+    bool empty() const { return ring.empty() && spilled.load(std::memory_order_acquire) == 0; }
+};
+
+/* Same levels as mlq_scheduler_t, lowest prio first, without a lock so
+ * CPUs dispatch concurrently. Each level is a FIFO lockfree_level_t and a
+ * bitmap tells which levels may hold processes */
+class lockfree_mlq_scheduler_t final : public sched_policy_t {
+private:
+    std::atomic<lockfree_level_t *> m_q_Ready[MAX_PRIO]{};    // Created on first use
+    /* Level prio is bit (63 - prio % 64) of word prio / 64, so counting
+     * leading zeros finds the lowest prio of a word */
+    std::atomic<uint64_t> m_Levels[MAX_PRIO / 64]{};
+public:
+    lockfree_mlq_scheduler_t() = default;
+
+    ~lockfree_mlq_scheduler_t() override;
+
+    /* Extract the process with the lowest prio, nullptr if none is ready */
+    std::shared_ptr<pcb_t> get_proc() override;
+
+    /* Add process to MLQ scheduler, never waits */
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* Highest [priority] first. Preempted processes wait in a run queue until
+ * the ready queue is drained, then the two queues swap */
+class scheduler_t final : public sched_policy_t {
 private:
     queue_t m_q_Ready;
     queue_t m_q_Run;
     std::mutex m_Lock;
 public:
     /* Extract processes from the priority queue */
-    std::shared_ptr<pcb_t> get_proc();
+    std::shared_ptr<pcb_t> get_proc() override;
 
     /* Add process to ready queue */
-    void add_proc(const std::shared_ptr<pcb_t> &proc);
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
 
     /* Add process to run queue */
-    void put_proc(const std::shared_ptr<pcb_t> &proc);
+    void put_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* Completely fair: the process with the least virtual runtime runs next.
+ * A slice adds SCHED_SCALE / weight to it, weights follow the Linux nice
+ * table with prio 0..39 standing for nice -20..19 (higher prio clamps to
+ * 19). Processes are kept in a red-black tree by virtual runtime, new ones
+ * start at the smallest virtual runtime queued so they do not starve the
+ * others */
+class cfs_scheduler_t final : public sched_policy_t {
+private:
+    std::multimap<uint64_t, std::shared_ptr<pcb_t>> _tree;
+    uint64_t _min_vruntime{};
+    std::mutex _lock;
+public:
+    std::shared_ptr<pcb_t> get_proc() override;
+
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
+
+    void put_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* Proportional share, a process holds MAX_PRIO - prio tickets. Each
+ * dispatch draws a ticket at random, O(n) in the ready processes */
+class lottery_scheduler_t final : public sched_policy_t {
+private:
+    std::vector<std::shared_ptr<pcb_t>> _ready;
+    uint64_t _tickets{};
+    std::mt19937_64 _rng;
+    std::mutex _lock;
+public:
+    explicit lottery_scheduler_t(uint64_t seed) : _rng(seed) {}
+
+    std::shared_ptr<pcb_t> get_proc() override;
+
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* Deterministic lottery: the smallest pass runs next and a slice adds
+ * SCHED_SCALE / tickets to it. Same tickets as lottery_scheduler_t */
+class stride_scheduler_t final : public sched_policy_t {
+private:
+    std::multimap<uint64_t, std::shared_ptr<pcb_t>> _ready;    // By pass
+    uint64_t _global_pass{};
+    std::mutex _lock;
+public:
+    std::shared_ptr<pcb_t> get_proc() override;
+
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
+
+    void put_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* Earliest deadline first, ties first in first out. Preemptive at time
+ * slice boundaries */
+class edf_scheduler_t final : public sched_policy_t {
+private:
+    std::multimap<uint64_t, std::shared_ptr<pcb_t>> _ready;    // By deadline
+    std::mutex _lock;
+public:
+    std::shared_ptr<pcb_t> get_proc() override;
+
+    void add_proc(const std::shared_ptr<pcb_t> &proc) override;
+};
+
+/* One MLQ per CPU, ordered as mlq_scheduler_t. A CPU puts its preempted
+ * process back into its own queue
+ * and serves it first, idle CPUs steal from the busiest peer. Priority
+ * still holds across CPUs: a CPU takes the best process of a peer instead
+ * of its own when the peer's is better by more than [tolerance] levels */
+class percpu_scheduler_t {
+private:
+    struct local_t {
+        std::mutex lock;
+        queue_t levels[MAX_PRIO];    // Guarded by lock, by prio
+        prio_bitmap_t used;    // Guarded by lock, levels holding processes
+        std::atomic<uint32_t> best{MAX_PRIO};    // Lowest prio queued, MAX_PRIO if empty
+        std::atomic<uint32_t> size{};
+        uint64_t steals{};    // Only touched by the owner CPU
+    };
+
+    std::vector<local_t> _cpus;
+    uint32_t _tolerance;
+    std::atomic<uint32_t> _next{};    // Round robin among the least loaded CPUs
+
+    void push(local_t &cpu, const std::shared_ptr<pcb_t> &proc);
+
+    std::shared_ptr<pcb_t> pop(local_t &cpu);
+
+public:
+    percpu_scheduler_t(int cpus, uint32_t tolerance);
+
+    /* Queue a new process on the least loaded CPU */
+    void add_proc(const std::shared_ptr<pcb_t> &proc);
+
+    /* Queue the process preempted on [cpu] there */
+    void put_proc(int cpu, const std::shared_ptr<pcb_t> &proc);
+
+    /* Next process for [cpu]: its own best one, unless a peer holds a
+     * process more than [tolerance] levels better, in which case the
+     * busiest peer within [tolerance] of the best level gives one */
+    std::shared_ptr<pcb_t> get_proc(int cpu);
+
+    /* Processes [cpu] took from its peers */
+    uint64_t steals(int cpu) const { return _cpus[cpu].steals; }
 };
-#endif
 
 #endif /* SCHEDULER_H */
 
@@ -9,13 +9,11 @@
 #include <cstdio>
 #include <cstdlib>
 
+/* A device taking part in the time slots. Every slot ends once all
+ * attached devices have called next_slot() or detach_event() */
 struct timer_id_t {
-	int done;
 	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	uint32_t sense;	/* Sense of the slot the device waits for the end of */
 };
 
 void start_timer();
@@ -28,6 +26,36 @@ void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
+/* Device waiting for an event that cannot come before slot [until] */
+#define NO_WAKE UINT64_MAX
+
+/* Same as next_slot() for a device with nothing to do before slot [until].
+ * When idle slots are skipped and every device is idle, the timer jumps
+ * to the earliest of them. Return the number of slots that went by */
+uint64_t idle_slot(struct timer_id_t* timer_id, uint64_t until);
+
 uint64_t current_time();
 
+/* In fast mode a time slot stands for a whole time slice: a CPU runs its
+ * process until the slice ends before waiting for the next slot */
+void set_fast_timer(int fast);
+
+int fast_timer();
+
+/* Skip the slots in which every device is idle, see idle_slot() */
+void set_skip_idle(int skip);
+
+/* Called with the first slot of every quantum before any device runs it,
+ * returns the next slot it has work in or NO_WAKE */
+typedef uint64_t (*tick_handler_t)(uint64_t now);
+
+void set_tick_handler(tick_handler_t handler);
+
+/* Every synchronization of the devices ends [slots] time slots at once,
+ * 1 by default. Call before start_timer() */
+void set_timer_quantum(uint32_t slots);
+
+/* Print a line at the start of every slot, the default */
+void set_timer_verbose(int verbose);
+
 #endif
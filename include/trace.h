@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+/* Events the OS reports. Without a trace file each one is printed as a
+ * line right away, with one each is appended to a ring of the calling
+ * thread and a writer thread saves them to the file in the background.
+ * tracedump turns the file back into the same lines */
+enum trace_type_t : uint8_t {
+    TRACE_SLOT,    // A time slot starts
+    TRACE_LOAD,    // [pid] arrives from [name] with prio [arg]
+    TRACE_FORK,    // [pid] is created by FORK
+    TRACE_DISPATCH,    // [cpu] starts a time slice of [pid]
+    TRACE_PUT,    // [cpu] preempts [pid]
+    TRACE_FINISH,    // [pid] ends on [cpu]
+    TRACE_STOP,    // [cpu] has nothing left to run
+    TRACE_NAME,    // In the file only: [arg] bytes of the name [pid] follow
+};
+
+struct trace_event_t {
+    uint64_t time;    // Slot of the event
+    trace_type_t type;
+    uint8_t pad;
+    uint16_t cpu;
+    uint32_t pid;
+    uint32_t arg;
+    uint32_t name;    // Index of a string saved with TRACE_NAME
+};
+
+#define TRACE_MAGIC "OSTRACE1"
+#define TRACE_RING_SIZE (1 << 16)    // Events per thread, a power of two
+
+/* Save the events to [path] from now on instead of printing them */
+void trace_open(const char *path);
+
+/* Write the events left and close the file. Without one, print the held
+ * events, leaving out the slot lines after the last event as a timer
+ * synchronizing every slot would */
+void trace_close();
+
+/* Report an event, printed right away unless a trace file is open */
+void trace_record(trace_type_t type, uint64_t time, int cpu, uint32_t pid, uint32_t arg = 0,
+                  const char *name = nullptr);
+
+/* The line printed for [event], [name] standing for its name index */
+void trace_print(FILE *out, const trace_event_t &event, const char *name);
+
+/* Order of the printed lines, for a stable sort: by slot, the slot line
+ * first, then the arrivals, which the timer admits before any CPU runs
+ * that slot, then the events of the CPUs in the order they were recorded */
+bool trace_before(const trace_event_t &a, const trace_event_t &b);
+
+/* Hold the printed events, in a buffer per thread, until trace_flush()
+ * puts them in order. When CPUs run several slots between two
+ * synchronizations the timer records every slot line of a quantum at its
+ * start */
+void trace_hold();
+
+/* Print the held events of the slots before [time]. Only called while
+ * the other threads recording events wait, see timer.cpp */
+void trace_flush(uint64_t time);
+
+#endif
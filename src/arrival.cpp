@@ -0,0 +1,152 @@
+
+#include "arrival.h"
+#include "schedu.h"
+
+#define PROC_DIR "input/proc/"
+
+distribution_t distribution_t::parse(const char *key, const char *value) {
+    distribution_t parsed;
+    char kind[16];
+    int fields = sscanf(value, "%15[a-z]:%lf:%lf", kind, &parsed.a, &parsed.b);
+    if (fields == 2 && !strcmp(kind, "fixed") && parsed.a >= 0) {
+        parsed.kind = FIXED;
+    } else if (fields == 3 && !strcmp(kind, "uniform") && parsed.a >= 0 && parsed.b >= parsed.a) {
+        parsed.kind = UNIFORM;
+    } else if (fields == 2 && !strcmp(kind, "exp") && parsed.a > 0) {
+        parsed.kind = EXP;
+    } else {
+        printf("Invalid %s: %s (expected fixed:N, uniform:MIN:MAX or exp:MEAN)\n", key, value);
+        exit(1);
+    }
+    return parsed;
+}
+
+uint64_t distribution_t::sample(std::mt19937_64 &rng) const {
+    switch (kind) {
+        case UNIFORM:
+            return std::uniform_int_distribution<uint64_t>((uint64_t) a, (uint64_t) b)(rng);
+        case EXP:
+            return (uint64_t) std::exponential_distribution<double>(1 / a)(rng);
+        default:
+            return (uint64_t) a;
+    }
+}
+
+int workload_spec_t::set(const char *key, const char *value) {
+    if (!strcmp(key, "arrivals")) {
+        gaps = distribution_t::parse(key, value);
+    } else if (!strcmp(key, "prios")) {
+        prios = distribution_t::parse(key, value);
+    } else if (!strcmp(key, "deadlines")) {
+        deadlines = distribution_t::parse(key, value);
+    } else if (!strcmp(key, "images")) {
+        images.clear();
+        std::stringstream list(value);
+        std::string image;
+        while (std::getline(list, image, ',')) {
+            size_t split = image.find(':');
+            double weight = split == std::string::npos ? 1 : atof(image.c_str() + split + 1);
+            if (image.empty() || weight <= 0) {
+                printf("Invalid images: %s (expected NAME or NAME:WEIGHT, separated by commas)\n", value);
+                exit(1);
+            }
+            images.emplace_back(image.substr(0, split), weight);
+        }
+    } else if (!strcmp(key, "seed")) {
+        seed = strtoull(value, nullptr, 10);
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/* Reads a line of the config file each time it is asked for a process */
+class config_source_t : public arrival_source_t {
+private:
+    FILE *_file;
+    std::string _path;
+    uint64_t _count;
+    uint64_t _read{};
+    char *_line{};
+    size_t _capacity{};
+
+public:
+    config_source_t(FILE *file, const char *path, uint64_t count) : _file(file), _path(path), _count(count) {}
+
+    ~config_source_t() override {
+        free(_line);
+        fclose(_file);
+    }
+
+    /* One process a line: start time, path, then optionally its prio
+     * (default 0) and its deadline relative to its arrival */
+    bool next(arrival_t &arrival) override {
+        if (_read == _count) {
+            return false;
+        }
+        std::string proc;
+        arrival = {};
+        if (getline(&_line, &_capacity, _file) < 0) {
+            printf("Invalid process %lu in configure file %s\n", _read, _path.c_str());
+            exit(1);
+        }
+        std::istringstream fields(_line);
+        if (!(fields >> arrival.start_time >> proc)) {
+            printf("Invalid process %lu in configure file %s\n", _read, _path.c_str());
+            exit(1);
+        }
+        fields >> arrival.prio >> arrival.deadline;
+        if (arrival.prio >= MAX_PRIO) {
+            printf("Invalid prio %u (expected below %d)\n", arrival.prio, MAX_PRIO);
+            exit(1);
+        }
+        arrival.path = PROC_DIR + proc;
+        _read++;
+        return true;
+    }
+};
+
+/* Draws each process from the distributions of a workload_spec_t */
+class generated_source_t : public arrival_source_t {
+private:
+    workload_spec_t _spec;
+    std::discrete_distribution<size_t> _image;
+    std::vector<std::string> _paths;
+    std::mt19937_64 _rng;
+    uint64_t _count;
+    uint64_t _made{};
+    uint64_t _time{};
+
+public:
+    generated_source_t(const workload_spec_t &spec, uint64_t count) : _spec(spec), _rng(spec.seed), _count(count) {
+        std::vector<double> weights;
+        for (const auto &[name, weight]: spec.images) {
+            _paths.push_back(PROC_DIR + name);
+            weights.push_back(weight);
+        }
+        _image = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+
+    bool next(arrival_t &arrival) override {
+        if (_made == _count) {
+            return false;
+        }
+        if (_made > 0) {
+            _time += _spec.gaps.sample(_rng);
+        }
+        arrival.start_time = _time;
+        arrival.path = _paths[_image(_rng)];
+        arrival.prio = std::min<uint64_t>(_spec.prios.sample(_rng), MAX_PRIO - 1);
+        arrival.deadline = _spec.deadlines.sample(_rng);
+        _made++;
+        return true;
+    }
+};
+
+std::unique_ptr<arrival_source_t> config_arrivals(FILE *file, const char *path, uint64_t count) {
+    return std::make_unique<config_source_t>(file, path, count);
+}
+
+std::unique_ptr<arrival_source_t> generated_arrivals(const workload_spec_t &spec, uint64_t count) {
+    return std::make_unique<generated_source_t>(spec, count);
+}
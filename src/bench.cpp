@@ -0,0 +1,919 @@
+
+#include "mem.h"
+#include "cpu.h"
+#include "loader.h"
+#include "schedu.h"
+#include "timer.h"
+
+/* Micro benchmarks for the simulator internals.
+ * Usage: bench <name> [arguments...] */
+
+extern memory_t g_Memory;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_sec(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/* Resident set size of this process in MiB */
+static double rss_mib() {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr) {
+        fscanf(statm, "%ld %ld", &pages, &resident);
+        fclose(statm);
+    }
+    return resident * (double) sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+/* Page table layout used before the arena: every second layer table sits
+ * in its own heap block behind a shared_ptr */
+struct legacy_trans_table_t {
+    struct entry_t {
+        addr_t v_index;
+        addr_t p_index;
+    };
+    entry_t table[1 << SECOND_LV_LEN];
+    int size;
+};
+
+struct legacy_page_table_t {
+    struct entry_t {
+        addr_t v_index{};
+        std::shared_ptr<legacy_trans_table_t> pages{};
+    };
+    std::vector<entry_t> table;
+
+    legacy_page_table_t() : table(1 << FIRST_LV_LEN) {}
+
+    __attribute__((noinline)) addr_t translate(addr_t virtual_addr) const {
+        addr_t offset = virtual_addr & ~((~0u) << OFFSET_LEN);
+        addr_t first_lv = virtual_addr >> (OFFSET_LEN + PAGE_LEN);
+        addr_t second_lv = (virtual_addr >> OFFSET_LEN) - (first_lv << PAGE_LEN);
+        std::shared_ptr<legacy_trans_table_t> trans_table = table[first_lv].pages;
+        if (table[first_lv].v_index && trans_table->table[second_lv].v_index) {
+            return trans_table->table[second_lv].p_index << OFFSET_LEN | offset;
+        }
+        return INVALID_ADDR;
+    }
+};
+
+/* bench translate [lookups]
+ * Map most of the default address space of one process, then translate short runs
+ * of bytes at random places with the legacy layout and the arena layout,
+ * and read them through read_mem with and without a TLB */
+static int bench_translate(int argc, char **argv) {
+    long lookups = argc > 0 ? atol(argv[0]) : 10000000;
+    pcb_t proc(1, 0);
+    addr_t start = g_Memory.alloc_mem(RAM_SIZE - 2 * PAGE_SIZE, &proc);
+    if (start == 0) {
+        printf("Cannot map the address space\n");
+        return 1;
+    }
+
+    /* Mirror the mapping into the legacy layout */
+    legacy_page_table_t legacy;
+    for (addr_t page = start; page < proc.bp; page += PAGE_SIZE) {
+        auto &entry = legacy.table[page >> (OFFSET_LEN + PAGE_LEN)];
+        if (!entry.v_index) {
+            entry.v_index = 1;
+            entry.pages = std::make_shared<legacy_trans_table_t>();
+        }
+        auto &pte = entry.pages->table[(page >> OFFSET_LEN) & ((1 << PAGE_LEN) - 1)];
+        pte.v_index = 1;
+        pte.p_index = g_Memory.translate(page, &proc) >> OFFSET_LEN;
+        entry.pages->size += 1;
+    }
+
+    std::vector<addr_t> addrs(1 << 16);
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < addrs.size(); i += 16) {
+        addr_t base = start + rng() % (proc.bp - start - 16);
+        for (addr_t j = 0; j < 16; j += 1) {
+            addrs[i + j] = base + j;
+        }
+    }
+
+    uint64_t sink = 0;
+    auto begin = bench_clock::now();
+    for (long i = 0; i < lookups; i += 1) {
+        sink += legacy.translate(addrs[i & (addrs.size() - 1)]);
+    }
+    double legacy_sec = elapsed_sec(begin);
+
+    begin = bench_clock::now();
+    for (long i = 0; i < lookups; i += 1) {
+        sink += g_Memory.translate(addrs[i & (addrs.size() - 1)], &proc);
+    }
+    double arena_sec = elapsed_sec(begin);
+
+    BYTE data;
+    begin = bench_clock::now();
+    for (long i = 0; i < lookups; i += 1) {
+        sink += g_Memory.read_mem(addrs[i & (addrs.size() - 1)], &proc, &data);
+    }
+    double walk_sec = elapsed_sec(begin);
+
+    tlb_t tlb;
+    memory_t::attach_tlb(&tlb);
+    begin = bench_clock::now();
+    for (long i = 0; i < lookups; i += 1) {
+        sink += g_Memory.read_mem(addrs[i & (addrs.size() - 1)], &proc, &data);
+    }
+    double tlb_sec = elapsed_sec(begin);
+    memory_t::attach_tlb(nullptr);
+
+    printf("translate: %ld lookups (checksum %lu)\n", lookups, sink);
+    printf("  translate, shared_ptr tables %8.2f Mlookups/s\n", lookups / legacy_sec / 1e6);
+    printf("  translate, arena tables      %8.2f Mlookups/s\n", lookups / arena_sec / 1e6);
+    printf("  read_mem, page table walk    %8.2f Mlookups/s\n", lookups / walk_sec / 1e6);
+    printf("  read_mem, TLB                %8.2f Mlookups/s (%lu hits, %lu misses)\n",
+           lookups / tlb_sec / 1e6, tlb.hits, tlb.misses);
+    g_Memory.free_mem(start, &proc);
+    return 0;
+}
+
+/* bench mem_stress [threads] [iterations]
+ * Every thread plays a CPU running its own process: it allocates regions,
+ * fills them with a tag, checks them back byte by byte and through blocks,
+ * copies between them and frees them, all at the same time as the others.
+ * Built with ThreadSanitizer by make test_stress */
+static int bench_mem_stress(int argc, char **argv) {
+    int threads = argc > 0 ? atoi(argv[0]) : 8;
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    std::atomic<long> errors{0}, failed_allocs{0};
+
+    auto worker = [&](int id) {
+        struct region_t {
+            addr_t addr;
+            uint32_t size;
+            BYTE tag;
+        };
+        pcb_t proc(1000 + id, 0);
+        tlb_t tlb;
+        memory_t::attach_tlb(&tlb);
+        std::vector<region_t> regions;
+        std::vector<BYTE> buf;
+        std::mt19937 rng(id);
+        for (long i = 0; i < iterations; i += 1) {
+            uint32_t op = rng() % 8;
+            if (regions.size() < 4 && op < 3) {
+                region_t region{0, 1 + (uint32_t) (rng() % (6 * g_Memory.page_size())), (BYTE) (id * 16 + i)};
+                region.addr = g_Memory.alloc_mem(region.size, &proc);
+                if (region.addr == 0) {
+                    /* Out of frames or out of address space, start over */
+                    failed_allocs += 1;
+                    for (const region_t &old: regions) {
+                        errors += g_Memory.free_mem(old.addr, &proc);
+                    }
+                    regions.clear();
+                    proc.bp = 0;
+                    continue;
+                }
+                errors += g_Memory.fill(region.addr, &proc, region.tag, region.size);
+                regions.push_back(region);
+            } else if (!regions.empty() && op < 5) {
+                /* Check one byte and the whole block */
+                const region_t &region = regions[rng() % regions.size()];
+                BYTE data = 0;
+                errors += g_Memory.read_mem(region.addr + rng() % region.size, &proc, &data);
+                errors += data != region.tag;
+                buf.resize(region.size);
+                errors += g_Memory.read_block(region.addr, &proc, buf.data(), region.size);
+                errors += std::count(buf.begin(), buf.end(), region.tag) != (long) region.size;
+            } else if (regions.size() >= 2 && op < 6) {
+                /* Copy a region over another one, which then takes its tag */
+                region_t &dst = regions[0];
+                const region_t &src = regions[1];
+                uint32_t size = std::min(dst.size, src.size);
+                errors += g_Memory.copy(dst.addr, src.addr, &proc, size);
+                errors += g_Memory.fill(dst.addr, &proc, src.tag, dst.size);
+                dst.tag = src.tag;
+            } else if (!regions.empty()) {
+                size_t victim = rng() % regions.size();
+                errors += g_Memory.write_mem(regions[victim].addr, &proc, regions[victim].tag);
+                errors += g_Memory.free_mem(regions[victim].addr, &proc);
+                regions.erase(regions.begin() + victim);
+            }
+        }
+        for (const region_t &region: regions) {
+            errors += g_Memory.free_mem(region.addr, &proc);
+        }
+        memory_t::attach_tlb(nullptr);
+    };
+
+    auto begin = bench_clock::now();
+    std::vector<std::thread> workers;
+    for (int id = 0; id < threads; id += 1) {
+        workers.emplace_back(worker, id);
+    }
+    for (std::thread &thread: workers) {
+        thread.join();
+    }
+    printf("mem_stress: %d threads x %ld iterations in %.2fs, %ld failed allocations, %ld errors\n",
+           threads, iterations, elapsed_sec(begin), failed_allocs.load(), errors.load());
+    return errors != 0;
+}
+
+/* bench rss [ram] [touched]
+ * Resident size of a simulated RAM of size [ram] (default 1G) with 4K
+ * pages, first eagerly zero-filled as the std::vector RAM was, then lazily
+ * mapped: when configured, after [touched] (default 64M) of it has been
+ * allocated and written, and after it has been freed with reclaim on */
+static int bench_rss(int argc, char **argv) {
+    mem_config_t mem_config;
+    mem_config.set("ram", argc > 0 ? argv[0] : "1G");
+    mem_config.set("page", "4K");
+    mem_config.set("vspace", "256T");
+    mem_config.set("levels", "4");
+    mem_config.reclaim = true;
+    size_t ram = (size_t) 1 << mem_config.ram_size;
+    uint32_t touched = argc > 1 ? atol(argv[1]) : 64 << 20;
+
+    double start = rss_mib();
+    printf("rss: %lu MiB of RAM, %u MiB touched\n", ram >> 20, touched >> 20);
+    printf("  at start                     %8.1f MiB\n", start);
+    {
+        auto begin = bench_clock::now();
+        std::vector<BYTE> eager(ram);
+        printf("  eager std::vector RAM        %8.1f MiB (%.3fs)\n", rss_mib(), elapsed_sec(begin));
+    }
+
+    auto begin = bench_clock::now();
+    g_Memory.configure(mem_config);
+    printf("  lazy RAM, configured         %8.1f MiB (%.3fs)\n", rss_mib(), elapsed_sec(begin));
+
+    pcb_t proc(1, 0);
+    addr_t region = g_Memory.alloc_mem(touched, &proc);
+    if (region == 0 || g_Memory.fill(region, &proc, 1, touched)) {
+        printf("Cannot allocate %u bytes\n", touched);
+        return 1;
+    }
+    printf("  lazy RAM, region written     %8.1f MiB\n", rss_mib());
+    g_Memory.free_mem(region, &proc);
+    printf("  lazy RAM, region freed       %8.1f MiB\n", rss_mib());
+    return 0;
+}
+
+/* bench paging [ram] [working set] [accesses] [threads]
+ * Demand paging with a working set (default 1M) larger than the RAM
+ * (default 256K), 1K pages. Every thread owns a process, writes a pattern
+ * over its share of the working set and then reads and writes it back at
+ * random, 80% of the accesses going to a fifth of the pages. Run once per
+ * replacement policy. With a single thread, fails if lru takes more
+ * faults than clock */
+static int bench_paging(int argc, char **argv) {
+    const char *ram = argc > 0 ? argv[0] : "256K";
+    uint32_t working_set = argc > 1 ? atol(argv[1]) : 1 << 20;
+    long accesses = argc > 2 ? atol(argv[2]) : 1000000;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    uint32_t share = working_set / threads;
+    int failed = 0;
+    std::map<std::string, uint64_t> faults;
+
+    printf("paging: %s of RAM, %u bytes working set, %ld accesses, %d threads\n",
+           ram, working_set, accesses, threads);
+    for (const char *policy: {"fifo", "clock", "lru"}) {
+        mem_config_t mem_config;
+        mem_config.set("ram", ram);
+        mem_config.set("page", "1K");
+        mem_config.set("vspace", "1G");
+        mem_config.set("paging", "demand");
+        mem_config.set("evict", policy);
+        g_Memory.configure(mem_config);
+
+        std::atomic<long> errors{0};
+        auto worker = [&](int id) {
+            pcb_t proc(1 + id, 0);
+            tlb_t tlb;
+            memory_t::attach_tlb(&tlb);
+            addr_t region = g_Memory.alloc_mem(share, &proc);
+            auto pattern = [](addr_t offset) { return (BYTE) (offset * 31 + (offset >> 10)); };
+            for (addr_t offset = 0; offset < share; offset += 1) {
+                errors += g_Memory.write_mem(region + offset, &proc, pattern(offset));
+            }
+            std::mt19937 rng(id);
+            uint32_t hot = std::max<uint32_t>(share / 5, 1);
+            for (long i = 0; i < accesses / threads; i += 1) {
+                addr_t offset = rng() % 10 < 8 ? rng() % hot : rng() % share;
+                BYTE data = 0;
+                if (i % 4 == 0) {
+                    errors += g_Memory.write_mem(region + offset, &proc, pattern(offset));
+                } else {
+                    errors += g_Memory.read_mem(region + offset, &proc, &data);
+                    errors += data != pattern(offset);
+                }
+            }
+            g_Memory.release(&proc);
+            memory_t::attach_tlb(nullptr);
+        };
+
+        auto begin = bench_clock::now();
+        std::vector<std::thread> workers;
+        for (int id = 0; id < threads; id += 1) {
+            workers.emplace_back(worker, id);
+        }
+        for (std::thread &thread: workers) {
+            thread.join();
+        }
+        double sec = elapsed_sec(begin);
+        paging_stat_t paging = g_Memory.paging_stat();
+        printf("  %-5s %8.3fs %10lu faults %10lu swap-ins %10lu swap-outs %ld errors\n",
+               policy, sec, paging.faults, paging.swap_ins, paging.swap_outs, errors.load());
+        failed |= errors != 0;
+        faults[policy] = paging.faults;
+    }
+    /* With several threads the faults depend on how they interleave */
+    if (threads == 1 && faults["lru"] > faults["clock"]) {
+        printf("  lru takes more faults than clock\n");
+        failed = 1;
+    }
+    return failed;
+}
+
+/* bench fork [children] [pages] [written]
+ * One process fills [pages] (default 64) pages and forks [children]
+ * (default 1000) copies of itself, then every child writes to [written]
+ * (default 4) of the pages. Report the frames used against the frames
+ * a full copy of every child would have needed */
+static int bench_fork(int argc, char **argv) {
+    int children = argc > 0 ? atoi(argv[0]) : 1000;
+    uint32_t pages = argc > 1 ? atol(argv[1]) : 64;
+    uint32_t written = argc > 2 ? atol(argv[2]) : 4;
+    mem_config_t mem_config;
+    mem_config.set("ram", "256M");
+    mem_config.set("page", "4K");
+    mem_config.set("vspace", "4G");
+    mem_config.set("levels", "3");
+    g_Memory.configure(mem_config);
+
+    addr_t page_size = g_Memory.page_size();
+    pcb_t parent(1, 0);
+    addr_t region = g_Memory.alloc_mem(pages * page_size, &parent);
+    if (region == 0 || g_Memory.fill(region, &parent, 1, pages * page_size)) {
+        printf("Cannot allocate %u pages\n", pages);
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<pcb_t>> procs;
+    auto begin = bench_clock::now();
+    for (int i = 0; i < children; i += 1) {
+        procs.push_back(std::make_unique<pcb_t>(2 + i, 0));
+        g_Memory.fork(&parent, procs.back().get());
+    }
+    double fork_sec = elapsed_sec(begin);
+    addr_t after_fork = g_Memory.used_frames();
+
+    long errors = 0;
+    begin = bench_clock::now();
+    for (const auto &proc: procs) {
+        for (uint32_t page = 0; page < std::min(written, pages); page += 1) {
+            errors += g_Memory.write_mem(region + page * page_size, proc.get(), 2);
+        }
+    }
+    double write_sec = elapsed_sec(begin);
+    addr_t after_write = g_Memory.used_frames();
+
+    /* Untouched pages still read the parent's data */
+    BYTE data = 0;
+    errors += g_Memory.read_mem(region + (pages - 1) * page_size, procs.back().get(), &data);
+    errors += data != (written >= pages ? 2 : 1);
+
+    uint64_t full_copy = (uint64_t) pages * (children + 1);
+    printf("fork: %d children of a %u page process, %u pages written by each\n",
+           children, pages, written);
+    printf("  fork                %8.2f us/child\n", fork_sec / children * 1e6);
+    printf("  copy on write       %8.2f us/page\n", write_sec / children / std::max(std::min(written, pages), 1u) * 1e6);
+    printf("  frames after fork   %8lu (%lu with full copies, %.1f%% saved)\n",
+           after_fork, full_copy, 100.0 * (full_copy - after_fork) / full_copy);
+    printf("  frames after writes %8lu (%.1f%% saved), %ld errors\n",
+           after_write, 100.0 * (full_copy - after_write) / full_copy, errors);
+    for (const auto &proc: procs) {
+        g_Memory.release(proc.get());
+    }
+    g_Memory.release(&parent);
+    return errors != 0;
+}
+
+/* bench ips [instructions] [slice]
+ * Instructions per second of both CPU engines on a synthetic process: one
+ * allocation, then a loop body of mostly CALC with reads, writes and
+ * fills. The switch engine runs one instruction per call as the tick
+ * timer does, the threaded engine both one per call and a [slice]
+ * (default 10) at a time as the fast timer does */
+static int bench_ips(int argc, char **argv) {
+    long instructions = argc > 0 ? atol(argv[0]) : 20000000;
+    uint32_t slice = argc > 1 ? atol(argv[1]) : 10;
+    const uint32_t body = 1000;
+
+    std::vector<inst_t> text(body + 1);
+    text[0] = {ALLOC, 4096, 0, 0};
+    std::mt19937 rng(42);
+    for (uint32_t pc = 1; pc <= body; pc++) {
+        uint32_t kind = rng() % 10;
+        if (kind < 7) {
+            text[pc] = {CALC, 0, 0, 0};
+        } else if (kind < 8) {
+            text[pc] = {READ, 0, (uint32_t) (rng() % 4096), 1};
+        } else if (kind < 9) {
+            text[pc] = {WRITE, (uint32_t) (rng() % 256), 0, (uint32_t) (rng() % 4096)};
+        } else {
+            text[pc] = {FILL, (uint32_t) (rng() % 256), 0, 64};
+        }
+    }
+    code_seg_t code(code_text_t(std::move(text)));
+
+    tlb_t tlb;
+    memory_t::attach_tlb(&tlb);
+    struct {
+        const char *name;
+        cpu_engine_t engine;
+        uint32_t budget;
+    } runs[] = {
+        {"switch, 1 per call  ", ENGINE_SWITCH, 1},
+        {"threaded, 1 per call", ENGINE_THREADED, 1},
+        {"threaded, slice     ", ENGINE_THREADED, slice},
+    };
+    std::vector<uint64_t> checksums;
+    printf("ips: %ld instructions, slice of %u\n", instructions, slice);
+    for (const auto &run: runs) {
+        pcb_t proc(1, 0);
+        proc.code = code;
+        long done = 0;
+        auto begin = bench_clock::now();
+        while (done < instructions) {
+            if (proc.pc == proc.code.text.size()) {
+                /* Loop over the body, keeping the allocation */
+                proc.pc = 1;
+            }
+            done += run_slice(&proc, run.budget, run.engine);
+        }
+        double sec = elapsed_sec(begin);
+
+        /* Both engines must leave the same memory behind */
+        std::vector<BYTE> data(4096);
+        g_Memory.read_block(proc.regs[0], &proc, data.data(), data.size());
+        checksums.push_back(std::accumulate(data.begin(), data.end(), (uint64_t) proc.regs[1]));
+        printf("  %s %8.2f Minstructions/s\n", run.name, done / sec / 1e6);
+        g_Memory.release(&proc);
+    }
+    memory_t::attach_tlb(nullptr);
+    bool same = std::equal(checksums.begin() + 1, checksums.end(), checksums.begin());
+    printf("  %s results\n", same ? "identical" : "DIFFERENT");
+    return !same;
+}
+
+/* Every CPU dispatches a process and puts it straight back, as a CPU does
+ * at the end of a time slice with nothing to run in between. Return the
+ * operations per second */
+template<typename scheduler_t>
+static double sched_contention(int cpus, long dispatches, uint32_t procs) {
+    scheduler_t scheduler;
+    for (uint32_t i = 0; i < procs; i++) {
+        auto proc = std::make_shared<pcb_t>(i + 1, 0);
+        proc->prio = i % 32;
+        scheduler.add_proc(proc);
+    }
+    std::atomic<long> misses{0};
+    auto worker = [&]() {
+        for (long i = 0; i < dispatches; i++) {
+            std::shared_ptr<pcb_t> proc = scheduler.get_proc();
+            if (!proc) {
+                misses += 1;
+                continue;
+            }
+            scheduler.add_proc(proc);
+        }
+    };
+    auto begin = bench_clock::now();
+    std::vector<std::thread> workers;
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread &thread: workers) {
+        thread.join();
+    }
+    double sec = elapsed_sec(begin);
+    /* Every process must still be there */
+    uint32_t left = 0;
+    while (scheduler.get_proc()) {
+        left++;
+    }
+    if (left != procs) {
+        printf("Lost %u processes\n", procs - left);
+        exit(1);
+    }
+    return 2.0 * (cpus * dispatches - misses) / sec;
+}
+
+/* bench sched [dispatches] [max cpus]
+ * Scheduler throughput in get_proc/add_proc pairs per second with 1, 2,
+ * 4... [max cpus] (default: hardware threads) CPUs each doing
+ * [dispatches] (default 200000) of them on 64 processes */
+static int bench_sched(int argc, char **argv) {
+    long dispatches = argc > 0 ? atol(argv[0]) : 200000;
+    int max_cpus = argc > 1 ? atoi(argv[1]) : (int) std::thread::hardware_concurrency();
+    printf("sched: %ld dispatches per CPU, 64 processes\n", dispatches);
+    printf("  %4s %16s %16s\n", "cpus", "mutex Mops/s", "lock-free Mops/s");
+    for (int cpus = 1; cpus <= max_cpus; cpus *= 2) {
+        double locked = sched_contention<mlq_scheduler_t>(cpus, dispatches, 64);
+        double lockfree = sched_contention<lockfree_mlq_scheduler_t>(cpus, dispatches, 64);
+        printf("  %4d %16.2f %16.2f\n", cpus, locked / 1e6, lockfree / 1e6);
+    }
+    return 0;
+}
+
+/* bench prio_check [rounds]
+ * Property check of prio_bitmap_t and of the MLQ scheduler built on it:
+ * after every step of random insertions and removals, first() must be
+ * the lowest level found by scanning a plain count per level, and
+ * get_proc() must return a process of that level as long as one is queued */
+static int bench_prio_check(int argc, char **argv) {
+    long rounds = argc > 0 ? atol(argv[0]) : 200;
+    std::mt19937 rng(7);
+    long checks = 0;
+    for (long round = 0; round < rounds; round++) {
+        prio_bitmap_t levels;
+        mlq_scheduler_t scheduler;
+        std::vector<uint32_t> count(MAX_PRIO);
+        /* Few levels in some rounds, all of them in others */
+        uint32_t spread = 1 + rng() % MAX_PRIO;
+        uint32_t base = rng() % (MAX_PRIO - spread + 1);
+        for (int step = 0; step < 1000; step++) {
+            auto naive = [&]() {
+                uint32_t prio = 0;
+                while (prio < MAX_PRIO && count[prio] == 0) {
+                    prio++;
+                }
+                return prio;
+            };
+            uint32_t prio = base + rng() % spread;
+            if (rng() % 2) {
+                auto proc = std::make_shared<pcb_t>(step + 1, 0);
+                proc->prio = prio;
+                scheduler.add_proc(proc);
+                levels.set(prio);
+                count[prio]++;
+            } else if (naive() < MAX_PRIO) {
+                uint32_t lowest = levels.first();
+                std::shared_ptr<pcb_t> proc = scheduler.get_proc();
+                if (lowest != naive() || !proc || proc->prio != lowest) {
+                    printf("prio_check: round %ld step %d: first() %u, get_proc() %d, naive scan %u\n",
+                           round, step, lowest, proc ? (int) proc->prio : -1, naive());
+                    return 1;
+                }
+                if (--count[lowest] == 0) {
+                    levels.clear(lowest);
+                }
+            } else if (levels.first() != MAX_PRIO || scheduler.get_proc()) {
+                printf("prio_check: round %ld step %d: not empty\n", round, step);
+                return 1;
+            }
+            checks++;
+        }
+    }
+    printf("prio_check: %ld checks passed\n", checks);
+    return 0;
+}
+
+/* bench prio [operations] [processes] [levels]
+ * Cost of finding the next level in get_proc() with the three strategies
+ * the MLQ scheduler had: scanning every level, a heap of the levels
+ * pushed by add_proc(), and the two-level bitmap. [processes] (default
+ * 64) are spread over the [levels] (default 512) lowest priorities, each
+ * operation dispatches the best one and queues it back at a random level */
+static int bench_prio(int argc, char **argv) {
+    long operations = argc > 0 ? atol(argv[0]) : 10000000;
+    uint32_t processes = argc > 1 ? atol(argv[1]) : 64;
+    uint32_t spread = argc > 2 ? std::clamp<uint32_t>(atol(argv[2]), 1, MAX_PRIO) : MAX_PRIO;
+    std::vector<uint32_t> prios(1 << 16);
+    std::mt19937 rng(3);
+    for (uint32_t &prio: prios) {
+        prio = rng() % spread;
+    }
+
+    auto measure = [&](auto init, auto next) {
+        std::vector<uint32_t> count(MAX_PRIO);
+        for (uint32_t i = 0; i < processes; i++) {
+            count[prios[i]]++;
+            init(prios[i]);
+        }
+        uint64_t sink = 0;
+        auto begin = bench_clock::now();
+        for (long i = 0; i < operations; i++) {
+            uint32_t prio = next(count);
+            sink += prio;
+            uint32_t again = prios[i & (prios.size() - 1)];
+            count[again]++;
+            init(again);
+        }
+        double sec = elapsed_sec(begin);
+        return std::make_pair(sec / operations * 1e9, sink);
+    };
+
+    auto naive = measure([](uint32_t) {}, [](std::vector<uint32_t> &count) {
+        uint32_t prio = 0;
+        while (count[prio] == 0) {
+            prio++;
+        }
+        count[prio]--;
+        return prio;
+    });
+
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<>> heap;
+    auto heaped = measure([&](uint32_t prio) { heap.push(prio); }, [&](std::vector<uint32_t> &count) {
+        uint32_t prio = heap.top();
+        heap.pop();
+        count[prio]--;
+        return prio;
+    });
+
+    prio_bitmap_t levels;
+    auto bitmap = measure([&](uint32_t prio) { levels.set(prio); }, [&](std::vector<uint32_t> &count) {
+        uint32_t prio = levels.first();
+        if (--count[prio] == 0) {
+            levels.clear(prio);
+        }
+        return prio;
+    });
+
+    printf("prio: %ld operations, %u processes over %u levels\n", operations, processes, spread);
+    printf("  naive scan %8.2f ns/op\n", naive.first);
+    printf("  heap       %8.2f ns/op\n", heaped.first);
+    printf("  bitmap     %8.2f ns/op\n", bitmap.first);
+    if (naive.second != heaped.second || naive.second != bitmap.second) {
+        printf("  strategies disagree\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* bench queue [processes]
+ * Fill a ready queue with [processes] (default 200000) processes of 16
+ * distinct priorities, drain it and check the order: highest priority
+ * first, first in first out among equals. Timed against the former
+ * std::priority_queue of shared_ptr, without its cap of 10, and through
+ * the MLQ scheduler with the processes spread over 64 levels */
+static int bench_queue(int argc, char **argv) {
+    size_t processes = argc > 0 ? atol(argv[0]) : 200000;
+    std::vector<std::shared_ptr<pcb_t>> procs;
+    std::mt19937 rng(5);
+    for (size_t i = 0; i < processes; i++) {
+        procs.push_back(std::make_shared<pcb_t>(i + 1, rng() % 16));
+        procs.back()->prio = rng() % 64;
+    }
+
+    struct by_priority {
+        bool operator()(const std::shared_ptr<pcb_t> &a, const std::shared_ptr<pcb_t> &b) const {
+            return a->priority < b->priority;
+        }
+    };
+    std::priority_queue<std::shared_ptr<pcb_t>, std::vector<std::shared_ptr<pcb_t>>, by_priority> legacy;
+    auto begin = bench_clock::now();
+    for (const auto &proc: procs) {
+        legacy.push(proc);
+    }
+    while (!legacy.empty()) {
+        legacy.pop();
+    }
+    double legacy_sec = elapsed_sec(begin);
+
+    long errors = 0;
+    queue_t queue;
+    begin = bench_clock::now();
+    for (const auto &proc: procs) {
+        queue.enqueue(proc);
+    }
+    std::shared_ptr<pcb_t> prev;
+    while (!queue.empty()) {
+        std::shared_ptr<pcb_t> proc = queue.dequeue();
+        if (prev && (proc->priority > prev->priority
+                     || (proc->priority == prev->priority && proc->pid < prev->pid))) {
+            errors++;
+        }
+        prev = std::move(proc);
+    }
+    double queue_sec = elapsed_sec(begin);
+
+    auto scheduler = std::make_unique<mlq_scheduler_t>();
+    begin = bench_clock::now();
+    for (const auto &proc: procs) {
+        scheduler->add_proc(proc);
+    }
+    size_t dispatched = 0;
+    uint32_t prev_prio = 0;
+    while (std::shared_ptr<pcb_t> proc = scheduler->get_proc()) {
+        errors += proc->prio < prev_prio;
+        prev_prio = proc->prio;
+        dispatched++;
+    }
+    double sched_sec = elapsed_sec(begin);
+    errors += dispatched != processes;
+
+    printf("queue: %lu processes\n", processes);
+    printf("  std::priority_queue %8.1f ns per enqueue+dequeue\n", legacy_sec / processes * 1e9);
+    printf("  intrusive queue_t   %8.1f ns per enqueue+dequeue\n", queue_sec / processes * 1e9);
+    printf("  MLQ scheduler       %8.1f ns per add_proc+get_proc, %lu dispatched\n",
+           sched_sec / processes * 1e9, dispatched);
+    printf("  %ld ordering errors\n", errors);
+    return errors != 0;
+}
+
+/* bench ticks [ticks] [max devices]
+ * Time slots per second with 1, 2, 4... [max devices] (default 64)
+ * devices each running [ticks] (default 20000) slots, without printing.
+ * Every device checks it sees the slots one by one */
+static int bench_ticks(int argc, char **argv) {
+    long ticks = argc > 0 ? atol(argv[0]) : 20000;
+    int max_devices = argc > 1 ? atoi(argv[1]) : 64;
+    set_timer_verbose(0);
+    printf("ticks: %ld slots\n", ticks);
+    printf("  %7s %14s\n", "devices", "ticks/s");
+    std::atomic<long> errors{0};
+    for (int devices = 1; devices <= max_devices; devices *= 2) {
+        std::vector<timer_id_t *> ids;
+        for (int i = 0; i < devices; i++) {
+            ids.push_back(attach_event());
+        }
+        auto begin = bench_clock::now();
+        start_timer();
+        std::vector<std::thread> threads;
+        for (timer_id_t *id: ids) {
+            threads.emplace_back([&errors, id, ticks]() {
+                for (long slot = 1; slot <= ticks; slot++) {
+                    next_slot(id);
+                    errors += current_time() != (uint64_t) slot;
+                }
+                detach_event(id);
+            });
+        }
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+        double sec = elapsed_sec(begin);
+        stop_timer();
+        printf("  %7d %14.0f\n", devices, ticks / sec);
+    }
+    printf("  %ld errors\n", errors.load());
+    return errors != 0;
+}
+
+/* bench load [instructions] [path]
+ * Time to load a synthetic process of [instructions] (default 2000000)
+ * from its text descriptor and from the compiled image of it, both
+ * written next to [path] (default /tmp/bench_load). The two must hold
+ * the same instructions. Loading the text again is served by the code
+ * segment cache, which also shares the decoded form of the text */
+static int bench_load(int argc, char **argv) {
+    long instructions = argc > 0 ? atol(argv[0]) : 2000000;
+    std::string text_path = argc > 1 ? argv[1] : "/tmp/bench_load";
+    std::string image_path = text_path + ".img";
+    static const char *names[] = {"calc", "alloc", "free", "read", "write", "fill", "copy", "fork"};
+    static const int args[] = {0, 2, 1, 3, 3, 3, 3, 1};
+    std::mt19937 rng(42);
+    FILE *text = fopen(text_path.c_str(), "w");
+    if (text == nullptr) {
+        printf("Cannot open %s\n", text_path.c_str());
+        return 1;
+    }
+    fprintf(text, "0 %ld\n", instructions);
+    for (long i = 0; i < instructions; i++) {
+        uint32_t opcode = rng() % 7;    // Anything but fork
+        fprintf(text, "%s", names[opcode]);
+        for (int arg = 0; arg < args[opcode]; arg++) {
+            fprintf(text, " %u", (uint32_t) (rng() % 4096));
+        }
+        fprintf(text, "\n");
+    }
+    fclose(text);
+
+    auto begin = bench_clock::now();
+    std::shared_ptr<pcb_t> parsed = load(text_path.c_str());
+    double text_sec = elapsed_sec(begin);
+    save_image(image_path.c_str(), parsed->code, parsed->priority);
+    begin = bench_clock::now();
+    std::shared_ptr<pcb_t> mapped = load(image_path.c_str());
+    double image_sec = elapsed_sec(begin);
+    begin = bench_clock::now();
+    std::shared_ptr<pcb_t> cached = load(text_path.c_str());
+    double cached_sec = elapsed_sec(begin);
+
+    long errors = parsed->code.text.size() != mapped->code.text.size()
+                  || memcmp(parsed->code.text.begin(), mapped->code.text.begin(),
+                            parsed->code.text.size() * sizeof(inst_t)) != 0;
+    errors += cached->code.text.begin() != parsed->code.text.begin();
+    int decodes = 0;
+    auto decode = [&](const code_text_t &) {
+        decodes++;
+        return std::shared_ptr<const decoded_code_t>();
+    };
+    for (const auto &proc: {parsed, cached, mapped}) {
+        proc->code.text.decoded(decode);
+    }
+    errors += decodes != 2;
+    printf("load: %ld instructions\n", instructions);
+    printf("  text descriptor %10.1f ms\n", text_sec * 1e3);
+    printf("  mapped image    %10.1f ms (%.1fx)\n", image_sec * 1e3, text_sec / image_sec);
+    printf("  cached          %10.4f ms\n", cached_sec * 1e3);
+    printf("  %ld errors\n", errors);
+    return errors != 0;
+}
+
+/* bench percpu_check
+ * Fixed cases of percpu_scheduler_t::get_proc(): a CPU takes its own
+ * process unless a peer holds one more than the tolerance better, even
+ * when it is idle and another peer has a longer queue of worse ones.
+ * Then a single CPU must dispatch in the same order as mlq */
+static int bench_percpu_check(int argc, char **argv) {
+    struct {
+        const char *name;
+        uint32_t tolerance;
+        std::vector<std::vector<uint32_t>> queued;    // Prios put on each CPU, CPU 0 dispatches
+        uint32_t expected;    // Prio CPU 0 must get
+    } cases[] = {
+        {"idle, strict", 0, {{}, {100, 100, 100, 100}, {0}}, 0},
+        {"idle, within tolerance", 10, {{}, {5, 5, 5, 5}, {0}}, 5},
+        {"idle, beyond tolerance", 10, {{}, {50, 50, 50, 50}, {0}}, 0},
+        {"local, strict", 0, {{50}, {}, {0}}, 0},
+        {"local, within tolerance", 60, {{50}, {}, {0}}, 50},
+        {"local, equal", 0, {{7}, {7, 7, 7}}, 7},
+    };
+    long errors = 0;
+    uint32_t pid = 1;
+    for (const auto &check: cases) {
+        percpu_scheduler_t scheduler((int) check.queued.size(), check.tolerance);
+        for (size_t cpu = 0; cpu < check.queued.size(); cpu++) {
+            for (uint32_t prio: check.queued[cpu]) {
+                auto proc = std::make_shared<pcb_t>(pid++, 0);
+                proc->prio = prio;
+                scheduler.put_proc((int) cpu, proc);
+            }
+        }
+        std::shared_ptr<pcb_t> proc = scheduler.get_proc(0);
+        if (!proc || proc->prio != check.expected) {
+            printf("percpu_check: %s: got prio %d, expected %u\n",
+                   check.name, proc ? (int) proc->prio : -1, check.expected);
+            errors++;
+        }
+    }
+    /* A single CPU dispatches as mlq does, by priority within a level */
+    mlq_scheduler_t mlq;
+    percpu_scheduler_t single(1, 0);
+    const uint32_t order[][2] = {{3, 1}, {3, 9}, {1, 0}, {3, 5}, {3, 9}, {1, 4}};    // prio, priority
+    for (const auto &it: order) {
+        for (int copy = 0; copy < 2; copy++) {
+            auto proc = std::make_shared<pcb_t>(pid, it[1]);
+            proc->prio = it[0];
+            if (copy == 0) {
+                mlq.add_proc(proc);
+            } else {
+                single.put_proc(0, proc);
+            }
+        }
+        pid++;
+    }
+    for (size_t i = 0; i < std::size(order); i++) {
+        std::shared_ptr<pcb_t> expected = mlq.get_proc(), proc = single.get_proc(0);
+        if (!proc || proc->pid != expected->pid) {
+            printf("percpu_check: dispatch %zu: got pid %d, mlq runs %u\n",
+                   i, proc ? (int) proc->pid : -1, expected->pid);
+            errors++;
+        }
+    }
+    printf("percpu_check: %zu cases, %ld errors\n", std::size(cases) + 1, errors);
+    return errors != 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} benches[] = {
+    {"translate", bench_translate},
+    {"mem_stress", bench_mem_stress},
+    {"rss", bench_rss},
+    {"paging", bench_paging},
+    {"fork", bench_fork},
+    {"ips", bench_ips},
+    {"sched", bench_sched},
+    {"prio_check", bench_prio_check},
+    {"percpu_check", bench_percpu_check},
+    {"prio", bench_prio},
+    {"queue", bench_queue},
+    {"ticks", bench_ticks},
+    {"load", bench_load},
+};
+
+int main(int argc, char **argv) {
+    for (const auto &bench: benches) {
+        if (argc >= 2 && !strcmp(argv[1], bench.name)) {
+            return bench.run(argc - 2, argv + 2);
+        }
+    }
+    printf("Usage: bench <name> [arguments...]\nAvailable:");
+    for (const auto &bench: benches) {
+        printf(" %s", bench.name);
+    }
+    printf("\n");
+    return 1;
+}
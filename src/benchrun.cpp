@@ -0,0 +1,68 @@
+
+#include "common.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Run a command and print a CSV row for it:
+ * LABEL,wall seconds,simulated slots,slots per second,peak RSS in KiB
+ * Usage: benchrun LABEL SLOTS COMMAND [arguments...]
+ *
+ * The standard output of the command is dropped. SLOTS is the number of
+ * slots the command simulates, or auto to take it from the line os
+ * prints on stderr at the end ("... processes in N slots ..."). Exit
+ * with the status of the command if it fails */
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: benchrun LABEL SLOTS COMMAND [arguments...]\n");
+        return 1;
+    }
+    int errors[2];
+    if (pipe(errors) != 0) {
+        printf("Cannot create a pipe\n");
+        return 1;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    pid_t child = fork();
+    if (child == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(errors[1], STDERR_FILENO);
+        close(errors[0]);
+        execv(argv[3], argv + 3);
+        fprintf(stderr, "Cannot run %s\n", argv[3]);
+        _exit(127);
+    }
+    close(errors[1]);
+    std::string output;
+    char buffer[4096];
+    ssize_t size;
+    while ((size = read(errors[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, size);
+    }
+    int status;
+    struct rusage usage{};
+    wait4(child, &status, 0, &usage);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed:\n%s", argv[3], output.c_str());
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+
+    uint64_t slots = 0;
+    if (strcmp(argv[2], "auto") != 0) {
+        slots = strtoull(argv[2], nullptr, 10);
+    } else {
+        size_t at = output.find(" processes in ");
+        if (at == std::string::npos) {
+            fprintf(stderr, "%s printed no slot count:\n%s", argv[3], output.c_str());
+            return 1;
+        }
+        slots = strtoull(output.c_str() + at + strlen(" processes in "), nullptr, 10);
+    }
+    /* ru_maxrss is in KiB on Linux */
+    printf("%s,%.3f,%lu,%.0f,%ld\n", argv[1], wall, slots, slots / wall, usage.ru_maxrss);
+    return 0;
+}
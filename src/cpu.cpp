@@ -1,10 +1,13 @@
 
 #include "cpu.h"
 #include "mem.h"
+#include "loader.h"
 
 /* Defined in paging.cpp */
 memory_t g_Memory;
 
+static spawn_handler_t spawn_handler = nullptr;
+
 static int calc(struct pcb_t *proc) {
     return ((unsigned long) proc & 0UL);
 }
@@ -47,6 +50,141 @@ static int write(
     return g_Memory.write_mem(proc->regs[destination] + offset, proc, data);
 }
 
+static int fill(
+    struct pcb_t *proc, // Process executing the instruction
+    BYTE data, // Value written to every byte of the range
+    uint32_t destination, // Index of register holding the first address
+    uint32_t size) { // Number of bytes
+    return g_Memory.fill(proc->regs[destination], proc, data, size);
+}
+
+static int copy(
+    struct pcb_t *proc, // Process executing the instruction
+    uint32_t source, // Index of register holding the source address
+    uint32_t destination, // Index of register holding the destination address
+    uint32_t size) { // Number of bytes
+    return g_Memory.copy(proc->regs[destination], proc->regs[source], proc, size);
+}
+
+static int fork(
+    struct pcb_t *proc, // Process executing the instruction
+    uint32_t reg_index) { // Register receiving the child PID, 0 in the child
+    if (spawn_handler == nullptr) {
+        return 1;
+    }
+    std::shared_ptr<pcb_t> child = std::make_shared<pcb_t>(new_pid(), proc->priority);
+    child->code = proc->code;
+    child->pc = proc->pc;
+    child->prio = proc->prio;
+    std::copy(std::begin(proc->regs), std::end(proc->regs), child->regs);
+    g_Memory.fork(proc, child.get());
+    proc->regs[reg_index] = child->pid;
+    child->regs[reg_index] = 0;
+    spawn_handler(child);
+    return 0;
+}
+
+void set_spawn_handler(spawn_handler_t handler) {
+    spawn_handler = handler;
+}
+
+/* One operation of a pre-decoded code segment */
+struct decoded_op_t {
+    uint32_t handler;    // Index in the label table of run_threaded
+    uint32_t pc;    // First instruction covered
+    uint32_t count;    // Instructions covered, more than one for fused CALC runs
+    uint32_t arg_0;
+    uint32_t arg_1;
+    uint32_t arg_2;
+};
+
+struct decoded_code_t {
+    std::vector<decoded_op_t> ops;    // Ends with an END operation
+    std::vector<uint32_t> op_at;    // Operation covering each pc, END for the last one
+};
+
+#define OP_END  (FORK + 1)
+
+static std::shared_ptr<const decoded_code_t> decode(const code_text_t &text) {
+    auto decoded = std::make_shared<decoded_code_t>();
+    decoded->op_at.resize(text.size() + 1);
+    for (uint32_t pc = 0; pc < text.size(); pc++) {
+        const inst_t &ins = text[pc];
+        if (ins.opcode == CALC && !decoded->ops.empty() && decoded->ops.back().handler == CALC) {
+            decoded->ops.back().count += 1;
+        } else {
+            decoded->ops.push_back({(uint32_t) ins.opcode, pc, 1, ins.arg_0, ins.arg_1, ins.arg_2});
+        }
+        decoded->op_at[pc] = decoded->ops.size() - 1;
+    }
+    decoded->ops.push_back({OP_END, (uint32_t) text.size(), 0, 0, 0, 0});
+    decoded->op_at[text.size()] = decoded->ops.size() - 1;
+    return decoded;
+}
+
+static uint32_t run_threaded(struct pcb_t *proc, uint32_t budget) {
+    static const void *labels[] = {
+        &&op_calc, &&op_alloc, &&op_free, &&op_read, &&op_write, &&op_fill, &&op_copy, &&op_fork, &&op_end
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == OP_END + 1);
+    if (proc->pc >= proc->code.text.size()) {
+        return 0;
+    }
+    /* Decoded once per code segment, shared by the processes loaded from
+     * the same file and by forked ones */
+    const decoded_code_t *decoded = proc->code.text.decoded(decode);
+    const decoded_op_t *op = &decoded->ops[decoded->op_at[proc->pc]];
+    uint32_t left = budget;
+
+/* Like run(), pc moves past an instruction before it executes */
+#define DISPATCH() do { if (left == 0) goto out; goto *labels[op->handler]; } while (0)
+#define EXECUTE(call) do { proc->pc++; call; left--; op++; DISPATCH(); } while (0)
+
+    DISPATCH();
+op_calc: {
+    /* The slice may end in the middle of the run */
+    uint32_t count = std::min(op->pc + op->count - proc->pc, left);
+    proc->pc += count;
+    left -= count;
+    if (proc->pc == op->pc + op->count) {
+        op++;
+    }
+    DISPATCH();
+}
+op_alloc:
+    EXECUTE(alloc(proc, op->arg_0, op->arg_1));
+op_free:
+    EXECUTE(free_data(proc, op->arg_0));
+op_read:
+    EXECUTE(read(proc, op->arg_0, op->arg_1, op->arg_2));
+op_write:
+    EXECUTE(write(proc, op->arg_0, op->arg_1, op->arg_2));
+op_fill:
+    EXECUTE(fill(proc, op->arg_0, op->arg_1, op->arg_2));
+op_copy:
+    EXECUTE(copy(proc, op->arg_0, op->arg_1, op->arg_2));
+op_fork:
+    EXECUTE(fork(proc, op->arg_0));
+op_end:
+out:
+    return budget - left;
+
+#undef EXECUTE
+#undef DISPATCH
+}
+
+uint32_t run_slice(struct pcb_t *proc, uint32_t budget, cpu_engine_t engine) {
+    if (engine == ENGINE_THREADED) {
+        return run_threaded(proc, budget);
+    }
+    uint32_t executed = 0;
+    while (executed < budget && proc->pc < proc->code.text.size()) {
+        run(proc);
+        executed++;
+    }
+    return executed;
+}
+
 int run(struct pcb_t *proc) {
     /* Check if Program Counter point to the proper instruction */
     if (proc->pc >= proc->code.text.size()) {
@@ -77,6 +215,15 @@ int run(struct pcb_t *proc) {
 //            printf("write %d %d %d\n", ins.arg_0, ins.arg_1, ins.arg_2);
             stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
             break;
+        case FILL:
+            stat = fill(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+            break;
+        case COPY:
+            stat = copy(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+            break;
+        case FORK:
+            stat = fork(proc, ins.arg_0);
+            break;
         default:
             stat = 1;
     }
@@ -1,13 +1,49 @@
 
 #include "loader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
 
-static uint32_t avail_pid = 1;
+/* Images are the in-memory instructions of a little endian host */
+static_assert(sizeof(inst_t) == 16 && sizeof(ins_opcode_t) == 4, "unexpected inst_t layout");
+static_assert(sizeof(image_header_t) == 32, "unexpected image header layout");
+
+static std::atomic<uint32_t> avail_pid{1};
+
+#define CODE_CACHE_MAX 1024
+
+/* Code segments already loaded, by path. Processes loaded from the same
+ * unchanged file share the instructions of the first one. At most
+ * CODE_CACHE_MAX files are kept, the least recently loaded one goes
+ * first, which only costs a later parse */
+struct cached_code_t {
+    /* The file, as fstat() found the one read */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    bool loading;    // Read by a thread, the others wait for it
+    uint32_t priority;
+    code_text_t text;
+    std::list<std::string>::iterator use;    // In cache_uses
+};
+
+static std::mutex cache_lock;
+static std::condition_variable cache_loaded;
+/* Guarded by cache_lock */
+static std::unordered_map<std::string, cached_code_t> code_cache;
+static std::list<std::string> cache_uses;    // Paths, the most recently loaded first
+static std::atomic<uint64_t> cache_hits{0};
 
 #define OPT_CALC        "calc"
 #define OPT_ALLOC       "alloc"
 #define OPT_FREE        "free"
 #define OPT_READ        "read"
 #define OPT_WRITE       "write"
+#define OPT_FILL        "fill"
+#define OPT_COPY        "copy"
+#define OPT_FORK        "fork"
 
 static enum ins_opcode_t get_opcode(const std::string& subj) {
     const char* opt = subj.c_str();
@@ -21,24 +57,108 @@ static enum ins_opcode_t get_opcode(const std::string& subj) {
         return READ;
     } else if (!strcmp(opt, OPT_WRITE)) {
         return WRITE;
+    } else if (!strcmp(opt, OPT_FILL)) {
+        return FILL;
+    } else if (!strcmp(opt, OPT_COPY)) {
+        return COPY;
+    } else if (!strcmp(opt, OPT_FORK)) {
+        return FORK;
     } else {
         printf("Opcode: %s\n", opt);
         exit(1);
     }
 }
 
+uint64_t image_checksum(const code_text_t &code) {
+    /* FNV-1a, a 32-bit word at a time */
+    uint64_t hash = 14695981039346656037ull;
+    for (const inst_t &it: code) {
+        uint32_t words[4];
+        memcpy(words, &it, sizeof(words));
+        for (uint32_t word: words) {
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+/* Map the compiled image open as [fd], nullptr if it is not one */
+static std::shared_ptr<pcb_t> load_image(int fd, const struct stat &info, const char *path, uint32_t pid) {
+    image_header_t header{};
+    if ((size_t) info.st_size < sizeof(header)
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+        return nullptr;
+    }
+    size_t size = info.st_size;
+    if (size != sizeof(header) + (size_t) header.code_size * sizeof(inst_t)) {
+        printf("Truncated process image: %s\n", path);
+        exit(1);
+    }
+    /* The code segment is read only, as is the mapping */
+    void *area = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (area == MAP_FAILED) {
+        printf("Cannot map process image: %s\n", path);
+        exit(1);
+    }
+    std::shared_ptr<const void> mapping(area, [size](const void *addr) { munmap((void *) addr, size); });
+    std::shared_ptr<pcb_t> proc = std::make_shared<pcb_t>(pid, header.priority);
+    proc->code.text = code_text_t(mapping, (const inst_t *) ((char *) area + sizeof(header)), header.code_size);
+    if (image_checksum(proc->code.text) != header.checksum) {
+        printf("Corrupted process image: %s\n", path);
+        exit(1);
+    }
+    for (const inst_t &it: proc->code.text) {
+        uint32_t opcode;
+        memcpy(&opcode, &it.opcode, sizeof(opcode));
+        if (opcode > FORK) {
+            printf("Invalid opcode %u in process image: %s\n", opcode, path);
+            exit(1);
+        }
+    }
+    return proc;
+}
+
+void save_image(const char *path, const code_seg_t &code, uint32_t priority) {
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+        printf("Cannot open process image %s\n", path);
+        exit(1);
+    }
+    image_header_t header{};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.priority = priority;
+    header.code_size = code.text.size();
+    header.checksum = image_checksum(code.text);
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(code.text.begin(), sizeof(inst_t), code.text.size(), file) != code.text.size()
+        || fclose(file) != 0) {
+        printf("Cannot write process image %s\n", path);
+        exit(1);
+    }
+}
+
 std::shared_ptr<pcb_t> load(const char *path) {
-    std::ifstream descriptor(path);
-    if (!descriptor) {
-        printf("Process descriptor not found: %s\n", path);
+    return load(path, new_pid());
+}
+
+/* Load the process at [path], open as [fd], whether or not it is cached */
+static std::shared_ptr<pcb_t> load_file(int fd, const struct stat &info, const char *path, uint32_t pid) {
+    std::shared_ptr<pcb_t> image = load_image(fd, info, path, pid);
+    if (image) {
+        return image;
+    }
+    std::string content(info.st_size, '\0');
+    if (pread(fd, content.data(), content.size(), 0) != (ssize_t) content.size()) {
+        printf("Cannot read process descriptor: %s\n", path);
         exit(1);
     }
+    std::istringstream descriptor(content);
     std::string opcode;
     int code_size, priority = 0;
     descriptor >> priority >> code_size;
-    std::shared_ptr<pcb_t> proc = std::make_shared<pcb_t>(avail_pid, priority, code_size);
-    avail_pid += 1;
-    for (inst_t &it: proc->code.text) {
+    std::vector<inst_t> text(std::max(code_size, 0));
+    for (inst_t &it: text) {
         descriptor >> opcode;
         it.opcode = get_opcode(opcode);
         switch (it.opcode) {
@@ -56,13 +176,101 @@ std::shared_ptr<pcb_t> load(const char *path) {
             case WRITE:
                 descriptor >> it.arg_0 >> it.arg_1 >> it.arg_2;
                 break;
+            case FILL:
+                descriptor >> it.arg_0 >> it.arg_1 >> it.arg_2;
+                break;
+            case COPY:
+                descriptor >> it.arg_0 >> it.arg_1 >> it.arg_2;
+                break;
+            case FORK:
+                descriptor >> it.arg_0;
+                break;
             default:
                 printf("Invalid opcode: %s\n", opcode.c_str());
                 exit(1);
         }
     }
+    std::shared_ptr<pcb_t> proc = std::make_shared<pcb_t>(pid, priority);
+    proc->code.text = code_text_t(std::move(text));
     return proc;
 }
 
+/* True if [cached] was loaded from the file described by [info] */
+static bool same_file(const cached_code_t &cached, const struct stat &info) {
+    return cached.dev == info.st_dev && cached.ino == info.st_ino && cached.size == info.st_size
+           && cached.mtime.tv_sec == info.st_mtim.tv_sec && cached.mtime.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+/*
+ * The file is opened once and the cache key comes from fstat() on that
+ * descriptor, so a file replaced meanwhile is not cached under the key of
+ * the old one. The first thread to miss reads the file without the lock,
+ * the others loading the same path wait for it instead of reading it too
+ */
+std::shared_ptr<pcb_t> load(const char *path, uint32_t pid) {
+    int fd = open(path, O_RDONLY);
+    struct stat info{};
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("Process descriptor not found: %s\n", path);
+        exit(1);
+    }
+    std::unique_lock<std::mutex> lock(cache_lock);
+    auto cached = code_cache.find(path);
+    while (cached != code_cache.end() && cached->second.loading) {
+        cache_loaded.wait(lock);
+        cached = code_cache.find(path);
+    }
+    if (cached != code_cache.end() && same_file(cached->second, info)) {
+        cache_uses.splice(cache_uses.begin(), cache_uses, cached->second.use);
+        std::shared_ptr<pcb_t> proc = std::make_shared<pcb_t>(pid, cached->second.priority);
+        proc->code.text = cached->second.text;
+        cache_hits++;
+        lock.unlock();
+        close(fd);
+        return proc;
+    }
+    if (cached == code_cache.end()) {
+        /* Make room, skipping the files other threads are reading */
+        for (auto last = cache_uses.end(); code_cache.size() >= CODE_CACHE_MAX && last != cache_uses.begin();) {
+            auto victim = code_cache.find(*--last);
+            if (!victim->second.loading) {
+                last = cache_uses.erase(last);
+                code_cache.erase(victim);
+            }
+        }
+        cache_uses.push_front(path);
+        cached = code_cache.emplace(path, cached_code_t{}).first;
+        cached->second.use = cache_uses.begin();
+    } else {
+        cache_uses.splice(cache_uses.begin(), cache_uses, cached->second.use);
+    }
+    cached->second.loading = true;
+    lock.unlock();
+
+    std::shared_ptr<pcb_t> proc = load_file(fd, info, path, pid);
+    close(fd);
+
+    lock.lock();
+    /* Files being read are never evicted, so the entry is still there */
+    cached_code_t &entry = code_cache.at(path);
+    entry.dev = info.st_dev;
+    entry.ino = info.st_ino;
+    entry.mtime = info.st_mtim;
+    entry.size = info.st_size;
+    entry.priority = proc->priority;
+    entry.text = proc->code.text;
+    entry.loading = false;
+    cache_loaded.notify_all();
+    return proc;
+}
+
+uint64_t cached_loads() {
+    return cache_hits;
+}
+
+uint32_t new_pid() {
+    return avail_pid++;
+}
+
 
 
@@ -1,8 +1,130 @@
 
 #include "mem.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* TLB of the CPU running on this thread */
+static thread_local tlb_t *t_tlb = nullptr;
+
+/* Reserve [size] bytes of zeroed memory that only become resident once
+ * they are written */
+static void *map_lazy(size_t size, const char *what) {
+    void *area = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        printf("Cannot reserve %lu bytes for %s\n", (unsigned long) size, what);
+        exit(1);
+    }
+    return area;
+}
+
+memory_t::memory_t() : _frames(0) {
+    configure(mem_config_t{});
+}
+
+memory_t::~memory_t() {
+    munmap(_mem_stat, num_pages() * sizeof(mem_stat_t));
+    munmap(_ram, (size_t) 1 << _cfg.ram_size);
+}
+
+void memory_t::configure(const mem_config_t &cfg) {
+    if (cfg.levels < 1 || cfg.levels > MAX_LEVELS || cfg.address_size > 48 || cfg.ram_size > 40
+        || cfg.offset_len >= cfg.ram_size || cfg.address_size < cfg.offset_len + cfg.levels) {
+        printf("Invalid memory geometry: vspace 2^%u, ram 2^%u, page 2^%u, %u levels\n",
+               cfg.address_size, cfg.ram_size, cfg.offset_len, cfg.levels);
+        exit(1);
+    }
+    if (_ram != nullptr) {
+        munmap(_mem_stat, num_pages() * sizeof(mem_stat_t));
+        munmap(_ram, (size_t) 1 << _cfg.ram_size);
+    }
+    _cfg = cfg;
+    /* Split the page number bits between the levels, the upper levels
+     * take the remainder */
+    uint32_t index_bits = _cfg.address_size - _cfg.offset_len;
+    uint32_t shift = _cfg.address_size;
+    for (uint32_t level = 0; level < _cfg.levels; level += 1) {
+        _level_len[level] = index_bits / _cfg.levels + (level < index_bits % _cfg.levels);
+        shift -= _level_len[level];
+        _level_shift[level] = shift;
+    }
+
+    /* A zeroed mem_stat_t is a free page */
+    _mem_stat = (mem_stat_t *) map_lazy(num_pages() * sizeof(mem_stat_t), "page status");
+    _frames = frame_bitmap_t(num_pages());
+    _ram = (BYTE *) map_lazy((size_t) 1 << _cfg.ram_size, "RAM");
+
+    _policy.reset();
+    _swap = swap_device_t();
+    _paging = paging_stat_t{};
+    if (_cfg.demand) {
+        _policy = make_page_policy(_cfg.evict, _mem_stat, num_pages());
+        _swap = swap_device_t(_cfg.swap, page_size());
+    }
+}
+
+/* Parse a power of two size with an optional K, M, G or T suffix and
+ * return its number of bits */
+static uint32_t parse_size_bits(const char *key, const char *value) {
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    const char *units = "KMGT";
+    const char *unit = *end ? strchr(units, toupper(*end)) : nullptr;
+    if (unit != nullptr && end[1] == '\0') {
+        size <<= 10 * (unit - units + 1);
+    } else if (*end != '\0') {
+        size = 0;
+    }
+    if (size == 0 || (size & (size - 1)) != 0) {
+        printf("Invalid %s: %s (expected a power of two such as 4K)\n", key, value);
+        exit(1);
+    }
+    return std::countr_zero(size);
+}
+
+int mem_config_t::set(const char *key, const char *value) {
+    if (!strcmp(key, "vspace")) {
+        address_size = parse_size_bits(key, value);
+    } else if (!strcmp(key, "ram")) {
+        ram_size = parse_size_bits(key, value);
+    } else if (!strcmp(key, "page")) {
+        offset_len = parse_size_bits(key, value);
+    } else if (!strcmp(key, "levels")) {
+        levels = atoi(value);
+    } else if (!strcmp(key, "reclaim")) {
+        reclaim = atoi(value) != 0;
+    } else if (!strcmp(key, "paging")) {
+        if (strcmp(value, "eager") && strcmp(value, "demand")) {
+            printf("Invalid paging: %s (expected eager or demand)\n", value);
+            exit(1);
+        }
+        demand = !strcmp(value, "demand");
+    } else if (!strcmp(key, "swap")) {
+        swap = value;
+    } else if (!strcmp(key, "evict")) {
+        evict = value;
+    } else {
+        return 1;
+    }
+    return 0;
+}
 
 addr_t memory_t::alloc_mem(uint32_t size, pcb_t *proc) {
-    std::unique_lock<std::mutex> lock(m_Lock);
+    auto begin = std::chrono::steady_clock::now();
+    addr_t address = alloc_region(size, proc);
+    _alloc_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count());
+    if (address == 0) {
+        _alloc_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+    return address;
+}
+
+addr_t memory_t::alloc_region(uint32_t size, pcb_t *proc) {
+    /* The page table of [proc] is ours for the whole call, physical frames
+     * are only locked while they are being picked */
+    std::unique_lock<std::mutex> mm_lock(proc->mm_lock);
     addr_t ret_mem = 0;
     /* Allocate [size] byte in the memory for the
      * process [proc] and save the address of the first
@@ -11,84 +133,50 @@ addr_t memory_t::alloc_mem(uint32_t size, pcb_t *proc) {
 
 //    uint32_t num_pages = (size % PAGE_SIZE) ? size / PAGE_SIZE :
 //                         size / PAGE_SIZE + 1; // Number of pages we will use
-    uint32_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    int mem_avail = 0; // We could allocate new memory region or not?
+    addr_t page_size = this->page_size();
+    addr_t num_pages = (size + page_size - 1) / page_size;
 
     /* First we must check if the amount of free memory in
      * virtual address space and physical address space is
      * large enough to represent the amount of required memory
      *
-     * If so, set 1 to [mem_avail].
-     * Hint: check [proc] bit in each page of _mem_stat
-     * to know whether this page has been used by a process.
+     * Free frames are tracked by [_frames], so its counter
+     * answers the physical side without walking _mem_stat.
      * For virtual memory space, check bp (break pointer).
      */
 
-    uint32_t available_pages = 0;
-    for (int i = 0; i < NUM_PAGES; i += 1) {
-        if (_mem_stat[i].proc <= 0) {
-            /* Not allocated */
-            available_pages += 1;
-        }
-        if (available_pages >= num_pages) {
-            break;
-        }
-    }
     /* Check if new memory region can be allocated
      *
      * On the physical address space, the number of pages must not be less than number of available pages
      * As for virtual address space, the size span from the breakpoint to its final segment must be less than the maximum address possible
-     * (not more than 20 bits)
+     * (not more than [address_size] bits). The first page is never used
+     * so that no region starts at address 0
      */
-    if (available_pages >= num_pages) {
-        if (proc->bp + (num_pages * PAGE_SIZE) <= RAM_SIZE) {
-            mem_avail = 1;
-        }
+    if (proc->bp == 0) {
+        proc->bp = page_size;
     }
+    if (proc->bp + (num_pages * page_size) > ((addr_t) 1 << _cfg.address_size)) {
+        return ret_mem;
+    }
+    addr_t v_page = proc->bp >> _cfg.offset_len;
 
-
-    if (mem_avail) {
-        /* We could allocate new memory region to the process */
-        ret_mem = proc->bp;
-        proc->bp += num_pages * PAGE_SIZE;
+    /* Frames picked for this region, in page order. With demand paging
+     * the region is only reserved, pages get a frame on first access */
+    static thread_local std::vector<long> frames;
+    frames.clear();
+    if (!_cfg.demand) {
+        std::unique_lock<std::mutex> lock(m_Lock);
+        if (_frames.available() < num_pages) {
+            return ret_mem;
+        }
         /* Update status of physical pages which will be allocated
-         * to [proc] in _mem_stat. Tasks to do:
-         * 	- Update [proc], [index], and [next] field
-         * 	- Add entries to segment table page tables of [proc]
-         * 	  to ensure accesses to allocated memory slot is
-         * 	  valid. */
-        for (long phys_index = 0,
-                 page_index = 0,
-                 prev_index = -1;; phys_index += 1) {
-            if (_mem_stat[phys_index].proc > 0) {
-                /* Allocated, skip */
-                continue;
-            }
-
-            /* Update the segment table */
-            /* Calculate the virtual address */
-            addr_t v_addr = ret_mem + (page_index * PAGE_SIZE);
-            // printf("Virtual address: %d\n", v_addr);
-
-            addr_t first_level_index = get_first_lv(v_addr);
-            addr_t second_level_index = get_second_lv(v_addr);
-
-            /* Update the level 1 segment */
-            auto &first_level_entry = proc->seg_table.table.at(first_level_index);
-            if (first_level_entry.v_index == 0) {
-                first_level_entry.v_index = 1;
-                first_level_entry.pages = std::make_shared<trans_table_t>();
-            }
-
-            /* Update the level 2 segment */
-            auto &second_level_entry = first_level_entry.pages->table[second_level_index];
-            second_level_entry.v_index = 1;
-            second_level_entry.p_index = (addr_t) phys_index;
-            first_level_entry.pages->size += 1;
-
-            /* Update the memory status */
+         * to [proc] in _mem_stat: [proc], [index], and [next] field */
+        addr_t page_index = 0;
+        long prev_index = -1;
+        do {
+            /* Lowest free frame, so the layout matches a linear scan */
+            long phys_index = _frames.take();
             if (prev_index >= 0) {
-                /* May cause problem by casting to int */
                 /* Phys index have type uint32_t with max value greater than int in _mem_stat
                  * However, ->next of the last page must be -1
                  * _mem_state entries will be long
@@ -97,65 +185,125 @@ addr_t memory_t::alloc_mem(uint32_t size, pcb_t *proc) {
             }
             prev_index = phys_index;
 
-            _mem_stat[phys_index].proc = proc->pid;
-            _mem_stat[phys_index].index = page_index;
-
+            set_owner(phys_index, proc, v_page + page_index, page_index, -1);
+            frames.push_back(phys_index);
             page_index += 1;
-            if (page_index >= num_pages) {
-                /* Last page has next of (-1) */
-                _mem_stat[phys_index].next = -1;
-                break;
-            }
+        } while (page_index < num_pages);
+    }
+
+    /* We could allocate new memory region to the process */
+    ret_mem = proc->bp;
+    proc->bp += num_pages * page_size;
+    /* Add entries to the page tables of [proc] to ensure accesses
+     * to allocated memory slot is valid */
+    for (addr_t page_index = 0; page_index < std::max<addr_t>(num_pages, 1); page_index += 1) {
+        /* Calculate the virtual address */
+        addr_t v_addr = ret_mem + (page_index * page_size);
+        page_table_entry_t &entry = map(v_addr, proc);
+        entry.flags = PTE_VALID;
+        if (!frames.empty()) {
+            entry.flags |= PTE_PRESENT;
+            entry.p_index = (addr_t) frames[page_index];
+        }
+        if (page_index + 1 >= num_pages) {
+            entry.flags |= PTE_LAST;
         }
     }
     return ret_mem;
 }
 
 int memory_t::free_mem(addr_t address, pcb_t *proc) {
-    std::unique_lock<std::mutex> lock(m_Lock);
+    std::unique_lock<std::mutex> mm_lock(proc->mm_lock);
     /* Release memory region allocated by [proc]. The first byte of
      * this region is indicated by [address]
-     * 	- Set flag [proc] of physical page use by the memory block
-     * 	  back to zero to indicate that it is free.
      * 	- Remove unused entries in segment table and page tables of
      * 	  the process [proc].
-     * 	- Remember to use lock to protect the memory from other
-     * 	  processes.  */
-    addr_t physical_addr = translate(address, proc);
-    if (physical_addr == INT32_MAX) {
+     * 	- Set flag [proc] of physical page use by the memory block
+     * 	  back to zero to indicate that it is free.
+     * The page table is guarded by the lock of [proc], the frames
+     * by the lock of the memory. */
+    if (walk(address, proc) == nullptr) {
         return 1;
     }
+    drop(address, proc, true);
+    return 0;
+}
 
-    addr_t physical_start = physical_addr >> OFFSET_LEN;
-    for (long physical_index = physical_start,
-             page_index = 0;
-         physical_index != -1; page_index += 1) {
-        addr_t virtual_addr = address + (page_index * PAGE_SIZE);
-        addr_t first_level_index = get_first_lv(virtual_addr);
-        addr_t second_level_index = get_second_lv(virtual_addr);
+void memory_t::release(pcb_t *proc) {
+    std::unique_lock<std::mutex> mm_lock(proc->mm_lock);
+    if (proc->bp != 0) {
+        drop(page_size(), proc, false);
+    }
+}
 
-        /* Clean second level */
-        auto &trans_table = proc->seg_table.table[first_level_index].pages;
-        trans_table->table[second_level_index].v_index = 0;
-        trans_table->size -= 1;
+void memory_t::drop(addr_t address, pcb_t *proc, bool region) {
+    /* Cached translations of this process are no longer valid */
+    proc->tlb_gen += 1;
 
-        /* Clean first level */
-        if (trans_table->size == 0) {
-            auto &page_table = proc->seg_table.table;
-            page_table[first_level_index].pages.reset();
-            page_table[first_level_index].v_index = 0;
+    /* Walk the pages in virtual order. The region ends with the page
+     * flagged as last, a whole address space at the break pointer */
+    static thread_local std::vector<long> frames, slots;
+    frames.clear();
+    slots.clear();
+    for (addr_t virtual_addr = address; virtual_addr < proc->bp; virtual_addr += page_size()) {
+        page_table_entry_t *entry = walk(virtual_addr, proc);
+        if (entry == nullptr) {
+            continue;
         }
+        if (entry->flags & PTE_PRESENT) {
+            frames.push_back((long) entry->p_index);
+        } else if (entry->flags & PTE_SWAPPED) {
+            slots.push_back((long) entry->p_index);
+        }
+        bool last = entry->flags & PTE_LAST;
 
-        /* Move to next mem_stat and clear */
-        _mem_stat[physical_index].proc = 0;
-        physical_index = _mem_stat[physical_index].next;
+        /* Clean the page tables */
+        unmap(virtual_addr, proc);
+        if (region && last) {
+            break;
+        }
+    }
+
+    /* Frames still mapped by a forked process stay, without an owner */
+    std::unique_lock<std::mutex> lock(m_Lock);
+    size_t freed = 0;
+    for (long physical_index: frames) {
+        mem_stat_t &stat = _mem_stat[physical_index];
+        stat.refs -= 1;
+        if (stat.owner == proc) {
+            stat.owner = nullptr;
+        }
+        if (stat.refs == 0) {
+            stat.proc = 0;
+            frames[freed++] = physical_index;
+        }
+    }
+    frames.resize(freed);
+    for (long slot: slots) {
+        _swap.release(slot);
+    }
+
+    /* Drop the host pages behind the freed frames while they are still
+     * ours. Only possible when a frame covers whole host pages, the next
+     * owner then reads zeroes */
+    if (_cfg.reclaim && page_size() % sysconf(_SC_PAGESIZE) == 0 && !frames.empty()) {
+        lock.unlock();
+        for (long physical_index: frames) {
+            madvise(_ram + (physical_index << _cfg.offset_len), page_size(), MADV_DONTNEED);
+        }
+        lock.lock();
+    }
+
+    /* Hand the frames back */
+    for (long physical_index: frames) {
+        _frames.release(physical_index);
     }
-    return 0;
 }
 
 int memory_t::read_mem(addr_t address, pcb_t *proc, BYTE *data) {
-    addr_t physical_addr = translate(address, proc);
-    if (physical_addr != INT32_MAX) {
+    std::unique_lock<std::mutex> mm_lock = pin(proc);
+    addr_t physical_addr = lookup(address, proc, mm_lock);
+    if (physical_addr != INVALID_ADDR) {
         *data = _ram[physical_addr];
         return 0;
     } else {
@@ -164,10 +312,11 @@ int memory_t::read_mem(addr_t address, pcb_t *proc, BYTE *data) {
 }
 
 int memory_t::write_mem(addr_t address, pcb_t *proc, BYTE data) {
-    addr_t physical_addr = translate(address, proc);
+    std::unique_lock<std::mutex> mm_lock = pin(proc);
+    addr_t physical_addr = lookup(address, proc, mm_lock, true);
     // printf("At: %d\n", physical_addr);
     // printf("Data -> memory: %d\n", data);
-    if (physical_addr != INT32_MAX) {
+    if (physical_addr != INVALID_ADDR) {
         _ram[physical_addr] = data;
         return 0;
     } else {
@@ -175,13 +324,338 @@ int memory_t::write_mem(addr_t address, pcb_t *proc, BYTE data) {
     }
 }
 
+template<typename span_op_t>
+int memory_t::for_each_span(addr_t address, pcb_t *proc, uint32_t size, bool write, span_op_t op) {
+    std::unique_lock<std::mutex> mm_lock = pin(proc);
+    uint32_t done = 0;
+    while (done < size) {
+        addr_t physical_addr = lookup(address + done, proc, mm_lock, write);
+        if (physical_addr == INVALID_ADDR) {
+            return 1;
+        }
+        /* Stop at the end of the page, the next one may be anywhere */
+        uint32_t span = std::min<addr_t>(size - done,
+                                         page_size() - get_offset(physical_addr));
+        op(physical_addr, done, span);
+        done += span;
+    }
+    return 0;
+}
+
+int memory_t::read_block(addr_t address, pcb_t *proc, BYTE *data, uint32_t size) {
+    return for_each_span(address, proc, size, false, [&](addr_t physical_addr, uint32_t done, uint32_t span) {
+        memcpy(data + done, &_ram[physical_addr], span);
+    });
+}
+
+int memory_t::write_block(addr_t address, pcb_t *proc, const BYTE *data, uint32_t size) {
+    return for_each_span(address, proc, size, true, [&](addr_t physical_addr, uint32_t done, uint32_t span) {
+        memcpy(&_ram[physical_addr], data + done, span);
+    });
+}
+
+int memory_t::fill(addr_t address, pcb_t *proc, BYTE data, uint32_t size) {
+    return for_each_span(address, proc, size, true, [&](addr_t physical_addr, uint32_t, uint32_t span) {
+        memset(&_ram[physical_addr], data, span);
+    });
+}
+
+int memory_t::copy(addr_t destination, addr_t source, pcb_t *proc, uint32_t size) {
+    /* Copying backward keeps an overlapping source intact when the
+     * destination is above it, as memmove does */
+    bool backward = destination > source && destination < source + size;
+    std::unique_lock<std::mutex> mm_lock = pin(proc);
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t left = size - done;
+        addr_t src = backward ? source + left - 1 : source + done;
+        addr_t dst = backward ? destination + left - 1 : destination + done;
+        addr_t src_phys = lookup(src, proc, mm_lock);
+        addr_t dst_phys = lookup(dst, proc, mm_lock, true);
+        if (src_phys == INVALID_ADDR || dst_phys == INVALID_ADDR) {
+            return 1;
+        }
+        if (mm_lock.owns_lock() && translate(src, proc) != src_phys) {
+            /* Loading the destination page pushed the source out */
+            continue;
+        }
+        /* Largest span which stays inside one page of both ranges */
+        uint32_t span;
+        if (backward) {
+            span = std::min<addr_t>({left, get_offset(src_phys) + 1, get_offset(dst_phys) + 1});
+            memmove(&_ram[dst_phys + 1 - span], &_ram[src_phys + 1 - span], span);
+        } else {
+            span = std::min<addr_t>({left, page_size() - get_offset(src_phys),
+                                     page_size() - get_offset(dst_phys)});
+            memmove(&_ram[dst_phys], &_ram[src_phys], span);
+        }
+        done += span;
+    }
+    return 0;
+}
+
+frame_bitmap_t::frame_bitmap_t(addr_t num_frames) :
+    _words((num_frames + 63) / 64, ~0ULL), _summary((_words.size() + 63) / 64, ~0ULL),
+    _free(num_frames), _low(0) {
+    /* Every frame starts free, bits past the last one stay clear */
+    if (num_frames % 64) {
+        _words.back() = (1ULL << (num_frames % 64)) - 1;
+    }
+    if (_words.size() % 64) {
+        _summary.back() = (1ULL << (_words.size() % 64)) - 1;
+    }
+}
+
+long frame_bitmap_t::take() {
+    if (_free == 0) {
+        return -1;
+    }
+    /* Skip summary words which are known to be empty */
+    while (_summary[_low] == 0) {
+        _low += 1;
+    }
+    addr_t word = _low * 64 + std::countr_zero(_summary[_low]);
+    addr_t bit = std::countr_zero(_words[word]);
+    _words[word] &= _words[word] - 1;
+    if (_words[word] == 0) {
+        _summary[word / 64] &= ~(1ULL << (word % 64));
+    }
+    _free -= 1;
+    return (long) word * 64 + bit;
+}
+
+void frame_bitmap_t::release(addr_t frame) {
+    addr_t word = frame / 64;
+    _words[word] |= 1ULL << (frame % 64);
+    _summary[word / 64] |= 1ULL << (word % 64);
+    _low = std::min(_low, word / 64);
+    _free += 1;
+}
+
+/* Frames leave in the order they got their page */
+class fifo_policy_t : public page_policy_t {
+private:
+    mem_stat_t *_stat;
+    addr_t _num_frames;
+    std::deque<std::pair<addr_t, uint32_t>> _queue;    // Frame and its stamp when mapped
+
+    bool stale(const std::pair<addr_t, uint32_t> &item) const {
+        return _stat[item.first].owner == nullptr || _stat[item.first].stamp != item.second;
+    }
+
+public:
+    fifo_policy_t(mem_stat_t *stat, addr_t num_frames) : _stat(stat), _num_frames(num_frames) {}
+
+    void mapped(addr_t frame) override {
+        /* Entries of freed or remapped frames are skipped lazily, drop
+         * them once they outnumber the frames */
+        if (_queue.size() >= 2 * _num_frames) {
+            std::erase_if(_queue, [this](const auto &item) { return stale(item); });
+        }
+        _queue.emplace_back(frame, _stat[frame].stamp);
+    }
+
+    long victim(const std::function<bool(addr_t)> &evict) override {
+        for (size_t tries = _queue.size(); tries > 0; tries--) {
+            std::pair<addr_t, uint32_t> item = _queue.front();
+            _queue.pop_front();
+            if (stale(item)) {
+                continue;
+            }
+            if (evict(item.first)) {
+                return (long) item.first;
+            }
+            _queue.push_back(item);
+        }
+        return -1;
+    }
+};
+
+/* Second chance: the hand sweeps the frames, sparing the referenced ones once */
+class clock_policy_t : public page_policy_t {
+private:
+    mem_stat_t *_stat;
+    addr_t _num_frames;
+    addr_t _hand{};
+
+public:
+    clock_policy_t(mem_stat_t *stat, addr_t num_frames) : _stat(stat), _num_frames(num_frames) {}
+
+    void mapped(addr_t) override {}
+
+    long victim(const std::function<bool(addr_t)> &evict) override {
+        /* The first sweep clears every referenced bit, give up after the second */
+        for (addr_t step = 0; step < 2 * _num_frames; step++) {
+            addr_t frame = _hand;
+            _hand = (_hand + 1) % _num_frames;
+            if (_stat[frame].owner == nullptr) {
+                continue;
+            }
+            if (std::atomic_ref<uint8_t>(_stat[frame].referenced).exchange(0, std::memory_order_relaxed)) {
+                continue;
+            }
+            if (evict(frame)) {
+                return (long) frame;
+            }
+        }
+        return -1;
+    }
+};
+
+/* LRU approximated by aging: every frame keeps the last 8 samples of its
+ * referenced bit, taken by a sweep over all the frames once 1/SWEEP_SHARE
+ * of them have been evicted since the last one. Victims are the frames
+ * that sweep found oldest, skipping those used or given a new page since */
+class lru_policy_t : public page_policy_t {
+private:
+    static const addr_t SWEEP_SHARE = 2;
+    static const int AGES = 256;
+
+    mem_stat_t *_stat;
+    addr_t _num_frames;
+    addr_t _evicted{};    // Since the last sweep
+    std::vector<std::pair<addr_t, uint32_t>> _order;    // Frame and its stamp, oldest first
+    size_t _next{};    // First frame of _order not offered yet
+
+    /* Age every frame and order the frames by age, a counting sort */
+    void sweep() {
+        size_t start[AGES + 1]{};
+        for (addr_t frame = 0; frame < _num_frames; frame++) {
+            mem_stat_t &stat = _stat[frame];
+            if (stat.owner != nullptr) {
+                uint8_t referenced = std::atomic_ref<uint8_t>(stat.referenced).exchange(0, std::memory_order_relaxed);
+                stat.age = (stat.age >> 1) | (referenced << 7);
+                start[stat.age + 1] += 1;
+            }
+        }
+        for (int age = 0; age < AGES; age++) {
+            start[age + 1] += start[age];
+        }
+        _order.resize(start[AGES]);
+        for (addr_t frame = 0; frame < _num_frames; frame++) {
+            if (_stat[frame].owner != nullptr) {
+                _order[start[_stat[frame].age]++] = {frame, _stat[frame].stamp};
+            }
+        }
+        _next = 0;
+        _evicted = 0;
+    }
+
+public:
+    lru_policy_t(mem_stat_t *stat, addr_t num_frames) : _stat(stat), _num_frames(num_frames) {}
+
+    void mapped(addr_t) override {}
+
+    long victim(const std::function<bool(addr_t)> &evict) override {
+        /* Give up once the frames of two fresh sweeps were all refused */
+        for (int sweeps = 0; sweeps < 2;) {
+            if (_next == _order.size() || _evicted * SWEEP_SHARE >= _num_frames) {
+                sweep();
+                sweeps++;
+            }
+            while (_next < _order.size()) {
+                auto [frame, stamp] = _order[_next++];
+                mem_stat_t &stat = _stat[frame];
+                if (stat.owner == nullptr || stat.stamp != stamp
+                    || std::atomic_ref<uint8_t>(stat.referenced).load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                if (evict(frame)) {
+                    _evicted++;
+                    return (long) frame;
+                }
+            }
+        }
+        return -1;
+    }
+};
+
+std::unique_ptr<page_policy_t> make_page_policy(const std::string &name,
+                                                mem_stat_t *stat, addr_t num_frames) {
+    if (name == "fifo") {
+        return std::make_unique<fifo_policy_t>(stat, num_frames);
+    } else if (name == "clock") {
+        return std::make_unique<clock_policy_t>(stat, num_frames);
+    } else if (name == "lru") {
+        return std::make_unique<lru_policy_t>(stat, num_frames);
+    }
+    printf("Unknown page replacement policy: %s (expected fifo, clock or lru)\n", name.c_str());
+    exit(1);
+}
+
+swap_device_t::swap_device_t(const std::string &path, size_t page_size) : _page_size(page_size) {
+    if (path != "mem") {
+        _fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (_fd < 0) {
+            printf("Cannot open swap file %s: %s\n", path.c_str(), strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+swap_device_t::~swap_device_t() {
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+swap_device_t &swap_device_t::operator=(swap_device_t &&other) noexcept {
+    std::swap(_fd, other._fd);
+    std::swap(_page_size, other._page_size);
+    std::swap(_store, other._store);
+    std::swap(_free_slots, other._free_slots);
+    std::swap(_slots, other._slots);
+    return *this;
+}
+
+long swap_device_t::store(const BYTE *page) {
+    long slot;
+    if (!_free_slots.empty()) {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    } else {
+        slot = _slots++;
+    }
+    off_t offset = (off_t) slot * _page_size;
+    if (_fd >= 0) {
+        if (pwrite(_fd, page, _page_size, offset) != (ssize_t) _page_size) {
+            printf("Cannot write to the swap file: %s\n", strerror(errno));
+            exit(1);
+        }
+    } else {
+        if (_store.size() < offset + _page_size) {
+            _store.resize(offset + _page_size);
+        }
+        memcpy(_store.data() + offset, page, _page_size);
+    }
+    return slot;
+}
+
+void swap_device_t::load(long slot, BYTE *page) {
+    off_t offset = (off_t) slot * _page_size;
+    if (_fd >= 0) {
+        if (pread(_fd, page, _page_size, offset) != (ssize_t) _page_size) {
+            printf("Cannot read from the swap file: %s\n", strerror(errno));
+            exit(1);
+        }
+    } else {
+        memcpy(page, _store.data() + offset, _page_size);
+    }
+    release(slot);
+}
+
+void swap_device_t::release(long slot) {
+    _free_slots.push_back(slot);
+}
+
 void memory_t::dump() {
-    int i;
-    for (i = 0; i < NUM_PAGES; i++) {
-        if (_mem_stat[i].proc != 0) {
-            printf("%03d: ", i);
+    uint32_t offset_len = _cfg.offset_len;
+    addr_t i;
+    for (i = 0; i < num_pages(); i++) {
+        if (_mem_stat[i].refs != 0) {
+            printf("%03lu: ", i);
             // printf("%05x-%05x - PID: %02d (idx %03d, nxt: %03ld)\n",
-            printf("%d-%d - PID: %02d (idx %03d, nxt: %03ld)\n",
+            printf("%lu-%lu - PID: %02d (idx %03d, nxt: %03ld)\n",
                 /*
                  * i = 0
                  * Shift left 10 -> 0000 0000 0000 0000
@@ -189,19 +663,19 @@ void memory_t::dump() {
                  * i = 1
                  * Shift left 10 -> 0000 0100 0000 0000
                  */
-                   i << OFFSET_LEN,
-                   ((i + 1) << OFFSET_LEN) - 1,
+                   i << offset_len,
+                   ((i + 1) << offset_len) - 1,
                    _mem_stat[i].proc,
                    _mem_stat[i].index,
                    _mem_stat[i].next
             );
-            int j;
-            for (j = i << OFFSET_LEN;
-                 j < ((i + 1) << OFFSET_LEN) - 1;
+            addr_t j;
+            for (j = i << offset_len;
+                 j < ((i + 1) << offset_len) - 1;
                  j++) {
 
                 if (_ram[j] != 0) {
-                    printf("\t%05x: %d\n", j, _ram[j]);
+                    printf("\t%05lx: %d\n", j, _ram[j]);
                 }
 
             }
@@ -209,7 +683,7 @@ void memory_t::dump() {
     }
 }
 
-addr_t memory_t::get_offset(addr_t addr) {
+addr_t memory_t::get_offset(addr_t addr) const {
     /*
      * 0u = unsigned 0 -> 0x0000
      * ~0u = not 0u = 0xFFFF
@@ -221,79 +695,353 @@ addr_t memory_t::get_offset(addr_t addr) {
      * To       (0000 0000) (0000 0000) (0000 0011) (1101 1010)
      */
 
-    /* Get the last 10 bits of the provided virtual address */
-    return addr & ~((~0u) << OFFSET_LEN);
+    /* Get the last [offset_len] bits of the provided virtual address */
+    return addr & ~((~(addr_t) 0) << _cfg.offset_len);
 }
 
-addr_t memory_t::get_first_lv(addr_t addr) {
+addr_t memory_t::get_index(addr_t addr, uint32_t level) const {
     /*
-     * addr =       11111111111111111111
-     * add >> 15 =  00000000000000011111
+     * With the default geometry there are two levels of 5 bits:
+     * addr =       11111|11111|1111111111
+     * level 0 =    11111
+     * level 1 =          11111
      */
-
-    /* Get the first 5 bits in front */
-    return addr >> (OFFSET_LEN + PAGE_LEN);
+    return (addr >> _level_shift[level]) & (((addr_t) 1 << _level_len[level]) - 1);
 }
 
-addr_t memory_t::get_second_lv(addr_t addr) {
-    /*
-     * addr =                           11111111111111111111
-     * get_first_lv(addr)               00000000000000011111
-     * get_first_lv(addr) << PAGE_LEN   00000000001111100000
-     * addr >> OFFSET_LEN               00000000001111111111
-     * [...]                            00000000000000011111
-     */
+page_table_entry_t *memory_t::walk(addr_t virtual_addr, pcb_t *proc) const {
+    page_table_t &page_table = proc->seg_table;
+    if (page_table.arena.empty() || (virtual_addr >> _cfg.address_size) != 0) {
+        return nullptr;
+    }
+    /* Follow the tables from the root down to the last level */
+    addr_t table = 0;
+    for (uint32_t level = 0;; level += 1) {
+        page_table_entry_t &entry = page_table.arena[table + get_index(virtual_addr, level)];
+        if (!(entry.flags & PTE_VALID)) {
+            return nullptr;
+        }
+        if (level == _cfg.levels - 1) {
+            return &entry;
+        }
+        table = entry.p_index;
+    }
+}
 
-    /* Get the second 5 bits in front */
-    return (addr >> OFFSET_LEN) - (get_first_lv(addr) << PAGE_LEN);
+page_table_entry_t &memory_t::map(addr_t virtual_addr, pcb_t *proc) const {
+    page_table_t &page_table = proc->seg_table;
+    if (page_table.arena.empty()) {
+        page_table.new_table(0, 1 << _level_len[0]);
+    }
+    /* Tables are only created on the way to a mapped page, so a sparse
+     * address space costs a few tables. Offsets are used instead of
+     * references because new_table() may move the arena */
+    addr_t table = 0;
+    for (uint32_t level = 0; level < _cfg.levels - 1; level += 1) {
+        addr_t slot = table + get_index(virtual_addr, level);
+        if (!(page_table.arena[slot].flags & PTE_VALID)) {
+            addr_t child = page_table.new_table(level + 1, 1 << _level_len[level + 1]);
+            page_table.arena[slot].flags = PTE_VALID;
+            page_table.arena[slot].p_index = child;
+        }
+        page_table.arena[slot].size += 1;
+        table = page_table.arena[slot].p_index;
+    }
+    return page_table.arena[table + get_index(virtual_addr, _cfg.levels - 1)];
 }
 
-/* Translate virtual address to physical address */
-addr_t memory_t::translate(addr_t virtual_addr, pcb_t *proc) {
-    /* Offset of the virtual address */
-    addr_t offset = get_offset(virtual_addr);
+void memory_t::unmap(addr_t virtual_addr, pcb_t *proc) const {
+    page_table_t &page_table = proc->seg_table;
+    /* Remember the entry used at every level on the way down */
+    addr_t path[MAX_LEVELS];
+    addr_t table = 0;
+    for (uint32_t level = 0; level < _cfg.levels; level += 1) {
+        path[level] = table + get_index(virtual_addr, level);
+        table = page_table.arena[path[level]].p_index;
+    }
+    page_table.arena[path[_cfg.levels - 1]] = page_table_entry_t{};
 
-    /* The first layer index */
-    addr_t first_lv = get_first_lv(virtual_addr);
+    /* Then drop the reference of each table to the one below it, releasing
+     * the tables which have nothing mapped anymore */
+    for (uint32_t level = _cfg.levels - 1; level > 0; level -= 1) {
+        page_table_entry_t &parent = page_table.arena[path[level - 1]];
+        parent.size -= 1;
+        if (parent.size == 0) {
+            page_table.release_table(level, parent.p_index);
+            parent = page_table_entry_t{};
+        }
+    }
+}
 
-    /* The second layer index */
-    addr_t second_lv = get_second_lv(virtual_addr);
+/* Translate virtual address to physical address */
+addr_t memory_t::translate(addr_t virtual_addr, pcb_t *proc) const {
     /*
-     * Example: 13535
+     * Example: 13535 with the default geometry
      * 00000|01101|0011011111
-     *
+     * Each level of the page table is indexed by its group of bits, the
+     * last level gives the physical page to which the offset is appended
+     */
+    page_table_entry_t *entry = walk(virtual_addr, proc);
+    if (entry == nullptr || !(entry->flags & PTE_PRESENT)) {
+        return INVALID_ADDR;
+    }
+
+    /*
+     * offset   = 0000000000|1100110101
+     * addr     = 1111111111|1111111111
+     * [...]    = 1111111111|1100110101
      */
-    /*std::bitset<20> virtual_addr_bits(virtual_addr);
-    std::bitset<10> offset_bits(offset);
-    std::bitset<5> first_lv_bits(first_lv);
-    std::bitset<5> second_lv_bits(second_lv);
-
-    std::cout << "Virtual address: " << virtual_addr_bits << "     " << virtual_addr << std::endl;
-    std::cout << "Offset bits:               " << offset_bits << "     " << offset << std::endl;
-    std::cout << "First level:     " << first_lv_bits << "                    " << first_lv << std::endl;
-    std::cout << "Second level:         " << second_lv_bits << "               " << second_lv << std::endl;*/
-
-    /* Search in the first level */
-    std::shared_ptr<trans_table_t> trans_table = proc->seg_table.table[first_lv].pages;
-    if (proc->seg_table.table[first_lv].v_index) {
-        if (trans_table->table[second_lv].v_index) {
-            /* Concatenate the offset of the virtual addess
-             * to [p_index] field of trans_table->table
-             */
-
-            /*
-             * offset   = 0000000000|1100110101
-             * addr     = 1111111111|1111111111
-             * [...]    = 1111111111|1100110101
-             */
-
-            /* Shift left by OFFSET_LEN (in this case is 10) then perform bitwise OR with offset
-             * to concatenate virtual address offset
-             */
-            return (trans_table->table[second_lv].p_index << OFFSET_LEN | offset);
-        }
-    }
-
-    /* uint32_t has more number needed for indexing in this exercise */
-    return INT32_MAX;
+    return entry->p_index << _cfg.offset_len | get_offset(virtual_addr);
+}
+
+addr_t memory_t::lookup(addr_t virtual_addr, pcb_t *proc, std::unique_lock<std::mutex> &mm_lock,
+                        bool write) {
+    tlb_t *tlb = t_tlb;
+    addr_t v_page = virtual_addr >> _cfg.offset_len;
+    tlb_entry_t *entry = nullptr;
+    addr_t physical_addr = INVALID_ADDR;
+    if (tlb != nullptr) {
+        entry = &tlb->entries[(v_page ^ (proc->pid * 7)) % TLB_SIZE];
+        if (entry->pid == proc->pid && entry->v_page == v_page && entry->gen == proc->tlb_gen
+            && (entry->writable || !write)) {
+            tlb->hits += 1;
+            physical_addr = entry->p_page << _cfg.offset_len | get_offset(virtual_addr);
+        } else {
+            tlb->misses += 1;
+        }
+    }
+
+    if (physical_addr == INVALID_ADDR) {
+        std::unique_lock<std::mutex> walk_lock(proc->mm_lock, std::defer_lock);
+        if (!mm_lock.owns_lock()) {
+            walk_lock.lock();
+        }
+        physical_addr = translate(virtual_addr, proc);
+        if (physical_addr == INVALID_ADDR && _cfg.demand) {
+            physical_addr = fault(virtual_addr, proc);
+        }
+        if (physical_addr == INVALID_ADDR) {
+            return physical_addr;
+        }
+        bool writable = !(walk(virtual_addr, proc)->flags & PTE_COW);
+        if (write && !writable) {
+            physical_addr = unshare(virtual_addr, proc);
+            if (physical_addr == INVALID_ADDR) {
+                return physical_addr;
+            }
+            writable = true;
+        }
+        if (entry != nullptr) {
+            entry->pid = proc->pid;
+            entry->gen = proc->tlb_gen;
+            entry->v_page = v_page;
+            entry->p_page = physical_addr >> _cfg.offset_len;
+            entry->writable = writable;
+        }
+    }
+
+    if (_cfg.demand) {
+        /* Tell the replacement policy the page is in use */
+        std::atomic_ref<uint8_t>(_mem_stat[physical_addr >> _cfg.offset_len].referenced)
+            .store(1, std::memory_order_relaxed);
+    }
+    return physical_addr;
+}
+
+std::unique_lock<std::mutex> memory_t::pin(pcb_t *proc) const {
+    if (_cfg.demand) {
+        return std::unique_lock<std::mutex>(proc->mm_lock);
+    }
+    return std::unique_lock<std::mutex>(proc->mm_lock, std::defer_lock);
+}
+
+addr_t memory_t::fault(addr_t virtual_addr, pcb_t *proc) {
+    page_table_entry_t *entry = walk(virtual_addr, proc);
+    if (entry == nullptr) {
+        /* Not allocated, a real segmentation fault */
+        return INVALID_ADDR;
+    }
+    addr_t v_page = virtual_addr >> _cfg.offset_len;
+
+    std::unique_lock<std::mutex> lock(m_Lock);
+    long frame = take_frame(proc, lock);
+    if (frame == -1) {
+        return INVALID_ADDR;
+    }
+    BYTE *page = _ram + ((addr_t) frame << _cfg.offset_len);
+    if (entry->flags & PTE_SWAPPED) {
+        _swap.load((long) entry->p_index, page);
+        _paging.swap_ins += 1;
+    } else {
+        /* First touch of the page */
+        memset(page, 0, page_size());
+    }
+    entry->flags = (entry->flags & ~PTE_SWAPPED) | PTE_PRESENT;
+    entry->p_index = frame;
+    set_owner(frame, proc, v_page, v_page, -1);
+    _policy->mapped(frame);
+    _paging.faults += 1;
+    return (addr_t) frame << _cfg.offset_len | get_offset(virtual_addr);
+}
+
+long memory_t::take_frame(pcb_t *proc, std::unique_lock<std::mutex> &lock) {
+    if (!_cfg.demand) {
+        return _frames.take();
+    }
+    long frame = get_frame(proc);
+    for (int retry = 0; frame == -1; retry++) {
+        /* Every resident page belongs to a process busy on another CPU,
+         * they let go of their page tables between accesses */
+        if (retry == FAULT_RETRIES) {
+            return -1;
+        }
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+        frame = get_frame(proc);
+    }
+    return frame;
+}
+
+addr_t memory_t::unshare(addr_t virtual_addr, pcb_t *proc) {
+    page_table_entry_t *entry = walk(virtual_addr, proc);
+    addr_t v_page = virtual_addr >> _cfg.offset_len;
+    addr_t shared = entry->p_index;
+
+    std::unique_lock<std::mutex> lock(m_Lock);
+    long frame = -1;
+    if (_mem_stat[shared].refs > 1) {
+        /* The extra reference keeps the frame from being evicted while
+         * m_Lock is let go to find a new one */
+        _mem_stat[shared].refs += 1;
+        frame = take_frame(proc, lock);
+        _mem_stat[shared].refs -= 1;
+        if (frame == -1) {
+            return INVALID_ADDR;
+        }
+    }
+    mem_stat_t &stat = _mem_stat[shared];
+    if (stat.refs == 1) {
+        /* The other processes are gone, the page is ours again */
+        if (frame != -1) {
+            _frames.release(frame);
+        }
+        if (stat.owner != proc) {
+            stat.owner = proc;
+            stat.v_page = v_page;
+            if (_policy) {
+                stat.stamp += 1;
+                _policy->mapped(shared);
+            }
+        }
+        entry->flags &= ~PTE_COW;
+        return translate(virtual_addr, proc);
+    }
+
+    memcpy(_ram + ((addr_t) frame << _cfg.offset_len), _ram + (shared << _cfg.offset_len), page_size());
+    stat.refs -= 1;
+    if (stat.owner == proc) {
+        stat.owner = nullptr;
+    }
+    set_owner(frame, proc, v_page, stat.index, -1);
+    if (_policy) {
+        _policy->mapped(frame);
+    }
+    entry->flags &= ~PTE_COW;
+    entry->p_index = frame;
+    /* Reads of the page may still be cached with the shared frame */
+    proc->tlb_gen += 1;
+    return translate(virtual_addr, proc);
+}
+
+void memory_t::fork(pcb_t *parent, pcb_t *child) {
+    std::unique_lock<std::mutex> mm_lock(parent->mm_lock);
+    child->seg_table = parent->seg_table;
+    child->bp = parent->bp;
+    /* Writes through the TLB must now fault to unshare */
+    parent->tlb_gen += 1;
+
+    static thread_local std::vector<BYTE> page;
+    page.resize(page_size());
+    std::unique_lock<std::mutex> lock(m_Lock);
+    for (addr_t virtual_addr = page_size(); virtual_addr < parent->bp; virtual_addr += page_size()) {
+        page_table_entry_t *entry = walk(virtual_addr, parent);
+        if (entry == nullptr) {
+            continue;
+        }
+        page_table_entry_t *copy = walk(virtual_addr, child);
+        if (entry->flags & PTE_PRESENT) {
+            entry->flags |= PTE_COW;
+            copy->flags |= PTE_COW;
+            _mem_stat[entry->p_index].refs += 1;
+        } else if (entry->flags & PTE_SWAPPED) {
+            /* Swap slots have no reference count, each process gets its own */
+            _swap.load((long) entry->p_index, page.data());
+            entry->p_index = _swap.store(page.data());
+            copy->p_index = _swap.store(page.data());
+        }
+    }
+}
+
+long memory_t::get_frame(pcb_t *proc) {
+    long frame = _frames.take();
+    if (frame != -1) {
+        return frame;
+    }
+    return _policy->victim([&](addr_t candidate) {
+        mem_stat_t &stat = _mem_stat[candidate];
+        pcb_t *owner = stat.owner;
+        if (owner == nullptr || stat.refs > 1) {
+            return false;
+        }
+        /* The lock of the faulting process is held. Other owners may be
+         * waiting for m_Lock while holding theirs, so only try */
+        std::unique_lock<std::mutex> owner_lock(owner->mm_lock, std::defer_lock);
+        if (owner != proc && !owner_lock.try_lock()) {
+            return false;
+        }
+        page_table_entry_t *entry = walk(stat.v_page << _cfg.offset_len, owner);
+        if (entry == nullptr || !(entry->flags & PTE_PRESENT) || entry->p_index != candidate) {
+            /* Its owner is freeing it */
+            return false;
+        }
+        entry->p_index = _swap.store(_ram + (candidate << _cfg.offset_len));
+        entry->flags = (entry->flags & ~(PTE_PRESENT | PTE_COW)) | PTE_SWAPPED;
+        owner->tlb_gen += 1;
+        _paging.swap_outs += 1;
+        return true;
+    });
+}
+
+void memory_t::set_owner(addr_t frame, pcb_t *proc, addr_t v_page, addr_t index, long next) {
+    mem_stat_t &stat = _mem_stat[frame];
+    stat.proc = proc->pid;
+    stat.index = index;
+    stat.next = next;
+    stat.refs = 1;
+    stat.owner = proc;
+    stat.v_page = v_page;
+    stat.stamp += 1;
+    std::atomic_ref<uint8_t>(stat.referenced).store(1, std::memory_order_relaxed);
+    stat.age = 0;
+}
+
+paging_stat_t memory_t::paging_stat() {
+    std::unique_lock<std::mutex> lock(m_Lock);
+    return _paging;
+}
+
+addr_t memory_t::used_frames() {
+    std::unique_lock<std::mutex> lock(m_Lock);
+    return num_pages() - _frames.available();
+}
+
+void memory_t::attach_tlb(tlb_t *tlb) {
+    t_tlb = tlb;
+}
+
+void tlb_t::flush() {
+    for (tlb_entry_t &entry: entries) {
+        entry.pid = 0;
+    }
 }
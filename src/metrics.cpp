@@ -0,0 +1,35 @@
+
+#include "metrics.h"
+
+uint64_t hdr_histogram_t::highest(uint32_t bucket) {
+    if (bucket < HDR_SUB_COUNT) {
+        return bucket;
+    }
+    uint32_t shift = bucket / HDR_SUB_COUNT - 1;
+    uint64_t lowest = (uint64_t) (bucket % HDR_SUB_COUNT + HDR_SUB_COUNT) << shift;
+    return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t hdr_histogram_t::percentile(double quantile) const {
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    /* Rank of the value, 1 for the smallest one */
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(quantile * total));
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HDR_BUCKETS; i++) {
+        seen += _counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(highest(i), max());
+        }
+    }
+    return max();
+}
+
+void hdr_histogram_t::json(FILE *out) const {
+    fprintf(out, "{\"count\": %lu, \"min\": %lu, \"mean\": %.2f, \"p50\": %lu, \"p90\": %lu, "
+                 "\"p99\": %lu, \"p99.9\": %lu, \"max\": %lu}",
+            count(), count() ? _min.load(std::memory_order_relaxed) : 0, mean(),
+            percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), max());
+}
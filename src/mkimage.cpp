@@ -0,0 +1,15 @@
+
+#include "loader.h"
+
+/* Compile a text process descriptor into an image load() maps instead of
+ * parsing it */
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("Usage: mkimage [process descriptor] [image]\n");
+        return 1;
+    }
+    std::shared_ptr<pcb_t> proc = load(argv[1]);
+    save_image(argv[2], proc->code, proc->priority);
+    return 0;
+}
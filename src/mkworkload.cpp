@@ -0,0 +1,244 @@
+
+#include "loader.h"
+#include "arrival.h"
+#include "schedu.h"
+
+/* Generate a workload: [images] process images input/proc/NAME_0...
+ * and the config input/NAME running [processes] of them.
+ * Usage: mkworkload NAME [option=value]...
+ *
+ * images=K          distinct process images (default 4)
+ * length=N          instructions of each image (default 200)
+ * mix=OP:W,...      weights of calc, alloc, free, read, write, fill and
+ *                   copy (default calc:60,alloc:5,free:5,read:15,write:15)
+ * working_set=SIZE  bytes a process keeps allocated at most, e.g. 16K (default 4K)
+ * regions=R         regions the working set is split into, 1 to 9 (default 4)
+ * format=F          image or text (default image)
+ * processes=N       processes in the config (default 16)
+ * cpus=C            CPUs in the config (default 4)
+ * time_slot=T       time slice in the config (default 2)
+ * arrivals=D        slots between two arrivals (default exp:16)
+ * prios=D           prio of each process (default fixed:0)
+ * seed=S            (default 1)
+ *
+ * D is a distribution as os takes them: fixed:N, uniform:MIN:MAX or exp:MEAN */
+
+/* Register reads are loaded into, the others hold the regions */
+#define SCRATCH_REG 9
+
+static const char *op_names[] = {"calc", "alloc", "free", "read", "write", "fill", "copy"};
+
+static struct {
+    uint32_t images{4};
+    uint32_t length{200};
+    std::vector<double> mix{60, 5, 5, 15, 15, 0, 0};    // By opcode, FORK excluded
+    uint64_t working_set{4096};
+    uint32_t regions{4};
+    bool text{false};
+    uint64_t processes{16};
+    uint32_t cpus{4};
+    uint32_t time_slot{2};
+    distribution_t arrivals{distribution_t::EXP, 16, 0};
+    distribution_t prios;
+    uint64_t seed{1};
+} spec;
+
+/* A size such as 512, 4K or 1M */
+static uint64_t parse_size(const char *key, const char *value) {
+    char *unit;
+    uint64_t size = strtoull(value, &unit, 10);
+    switch (*unit) {
+        case 'K':
+            size <<= 10;
+            break;
+        case 'M':
+            size <<= 20;
+            break;
+        case 'G':
+            size <<= 30;
+            break;
+        case '\0':
+            break;
+        default:
+            size = 0;
+    }
+    if (size == 0) {
+        printf("Invalid %s: %s (expected a size such as 4K)\n", key, value);
+        exit(1);
+    }
+    return size;
+}
+
+static void set_option(const std::string &option) {
+    size_t split = option.find('=');
+    if (split == std::string::npos) {
+        printf("Invalid option: %s\n", option.c_str());
+        exit(1);
+    }
+    std::string key = option.substr(0, split);
+    const char *value = option.c_str() + split + 1;
+    if (key == "images") {
+        spec.images = std::max(1, atoi(value));
+    } else if (key == "length") {
+        spec.length = std::max(1, atoi(value));
+    } else if (key == "mix") {
+        std::fill(spec.mix.begin(), spec.mix.end(), 0);
+        std::stringstream list(value);
+        std::string op;
+        while (std::getline(list, op, ',')) {
+            size_t colon = op.find(':');
+            auto name = std::find_if(std::begin(op_names), std::end(op_names),
+                                     [&](const char *it) { return op.compare(0, colon, it) == 0; });
+            if (colon == std::string::npos || name == std::end(op_names)) {
+                printf("Invalid mix: %s (expected OP:WEIGHT separated by commas)\n", value);
+                exit(1);
+            }
+            spec.mix[name - std::begin(op_names)] = atof(op.c_str() + colon + 1);
+        }
+    } else if (key == "working_set") {
+        spec.working_set = parse_size(key.c_str(), value);
+    } else if (key == "regions") {
+        spec.regions = std::clamp(atoi(value), 1, SCRATCH_REG);
+    } else if (key == "format") {
+        if (strcmp(value, "image") && strcmp(value, "text")) {
+            printf("Invalid format: %s (expected image or text)\n", value);
+            exit(1);
+        }
+        spec.text = !strcmp(value, "text");
+    } else if (key == "processes") {
+        spec.processes = strtoull(value, nullptr, 10);
+    } else if (key == "cpus") {
+        spec.cpus = std::max(1, atoi(value));
+    } else if (key == "time_slot") {
+        spec.time_slot = std::max(1, atoi(value));
+    } else if (key == "arrivals") {
+        spec.arrivals = distribution_t::parse(key.c_str(), value);
+    } else if (key == "prios") {
+        spec.prios = distribution_t::parse(key.c_str(), value);
+    } else if (key == "seed") {
+        spec.seed = strtoull(value, nullptr, 10);
+    } else {
+        printf("Unknown option: %s\n", key.c_str());
+        exit(1);
+    }
+}
+
+/* Instructions drawn from the mix, accessing random bytes of the live
+ * regions. Anything but calc is an allocation while no region is live,
+ * allocations with every region live and copies with a single one are
+ * writes instead */
+static code_seg_t make_code(std::mt19937_64 &rng) {
+    std::discrete_distribution<int> pick(spec.mix.begin(), spec.mix.end());
+    uint32_t region_size = std::max<uint64_t>(1, spec.working_set / spec.regions);
+    std::vector<uint32_t> live;    // Registers holding a region
+    std::vector<uint32_t> spare;
+    for (uint32_t reg = spec.regions; reg > 0; reg--) {
+        spare.push_back(reg - 1);
+    }
+    std::vector<inst_t> text(spec.length);
+    for (inst_t &it: text) {
+        int op = pick(rng);
+        if (op != CALC && live.empty()) {
+            op = ALLOC;
+        } else if ((op == ALLOC && spare.empty()) || (op == COPY && live.size() < 2)) {
+            op = WRITE;
+        }
+        auto any_live = [&]() { return live[rng() % live.size()]; };
+        auto offset = [&](uint32_t size) { return (uint32_t) (rng() % size); };
+        switch (op) {
+            case ALLOC:
+                it = {ALLOC, region_size, spare.back(), 0};
+                live.push_back(spare.back());
+                spare.pop_back();
+                break;
+            case FREE: {
+                size_t index = rng() % live.size();
+                it = {FREE, live[index], 0, 0};
+                spare.push_back(live[index]);
+                live.erase(live.begin() + (long) index);
+                break;
+            }
+            case READ:
+                it = {READ, any_live(), offset(region_size), SCRATCH_REG};
+                break;
+            case WRITE:
+                it = {WRITE, (uint32_t) (rng() % 256), any_live(), offset(region_size)};
+                break;
+            case FILL:
+                it = {FILL, (uint32_t) (rng() % 256), any_live(), 1 + offset(region_size)};
+                break;
+            case COPY: {
+                uint32_t source = any_live(), destination;
+                do {
+                    destination = any_live();
+                } while (destination == source);
+                it = {COPY, source, destination, 1 + offset(region_size)};
+                break;
+            }
+            default:
+                it = {CALC, 0, 0, 0};
+        }
+    }
+    return code_seg_t(code_text_t(std::move(text)));
+}
+
+static void save_text(const char *path, const code_seg_t &code) {
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        printf("Cannot open %s\n", path);
+        exit(1);
+    }
+    static const int args[] = {0, 2, 1, 3, 3, 3, 3};
+    fprintf(file, "0 %zu\n", code.text.size());
+    for (const inst_t &it: code.text) {
+        fprintf(file, "%s", op_names[it.opcode]);
+        const uint32_t values[] = {it.arg_0, it.arg_1, it.arg_2};
+        for (int arg = 0; arg < args[it.opcode]; arg++) {
+            fprintf(file, " %u", values[arg]);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: mkworkload NAME [option=value]...\n");
+        return 1;
+    }
+    std::string name = argv[1];
+    for (int option = 2; option < argc; option++) {
+        set_option(argv[option]);
+    }
+    std::mt19937_64 rng(spec.seed);
+
+    for (uint32_t i = 0; i < spec.images; i++) {
+        std::string path = "input/proc/" + name + "_" + std::to_string(i);
+        code_seg_t code = make_code(rng);
+        if (spec.text) {
+            save_text(path.c_str(), code);
+        } else {
+            save_image(path.c_str(), code, 0);
+        }
+    }
+
+    std::string path = "input/" + name;
+    FILE *config = fopen(path.c_str(), "w");
+    if (config == nullptr) {
+        printf("Cannot open %s\n", path.c_str());
+        return 1;
+    }
+    fprintf(config, "%u %u %lu\n", spec.time_slot, spec.cpus, spec.processes);
+    uint64_t time = 0;
+    for (uint64_t i = 0; i < spec.processes; i++) {
+        if (i > 0) {
+            time += spec.arrivals.sample(rng);
+        }
+        fprintf(config, "%lu %s_%lu %lu\n", time, name.c_str(), rng() % spec.images,
+                std::min<uint64_t>(spec.prios.sample(rng), MAX_PRIO - 1));
+    }
+    fclose(config);
+    printf("%s: %u images of %u instructions, %lu processes\n",
+           path.c_str(), spec.images, spec.length, spec.processes);
+    return 0;
+}
@@ -3,192 +3,660 @@
 #include "timer.h"
 #include "schedu.h"
 #include "loader.h"
+#include "mem.h"
+#include "trace.h"
+#include "arrival.h"
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
 
-#ifdef MLQ_SCHED
-static mlq_scheduler_t g_Scheduler;
-#else
-static scheduler_t g_Scheduler;
-#endif
-
-static struct ld_args {
-    char **path;
-    unsigned long *start_time;
-#ifdef MLQ_SCHED
-    unsigned long *prio;
-#endif
-} ld_processes;
-int num_processes;
+extern memory_t g_Memory;
+static mem_config_t mem_config;
+static cpu_engine_t engine = ENGINE_SWITCH;
+static bool percpu = false;
+static uint32_t tolerance = 0;
+static std::string policy = "mlq";
+static uint32_t quantum = 1;    // Time slots a CPU runs between two synchronizations
+static std::string trace_path;    // Events are printed unless set
+static std::string metrics_path;    // Metrics are saved there as JSON if set
+static bool verbose = false;    // Per CPU statistics are printed, also with metrics=
+static int loaders = -1;    // Threads parsing processes ahead of their arrival, -1 picks
+
+static std::unique_ptr<sched_policy_t> g_Scheduler;
+/* Replaces g_Scheduler with runqueue=percpu */
+static std::unique_ptr<percpu_scheduler_t> g_PerCpu;
+
+/* A finished process, in time slots */
+struct proc_stat_t {
+    uint32_t pid;
+    uint64_t arrival;
+    uint64_t waiting;    // Ready but not running
+    uint64_t turnaround;    // Arrival to finish
+    uint64_t response;    // Arrival to first dispatch
+};
+
+/* Statistics of the processes, in time slots */
+static struct {
+    hdr_histogram_t waiting;
+    hdr_histogram_t turnaround;
+    hdr_histogram_t response;
+    std::atomic<uint64_t> last;    // Slot the last process finished in
+    std::mutex lock;
+    std::vector<proc_stat_t> finished;    // Guarded by lock, the first METRICS_EACH with metrics=
+} sched_stat;
+
+/* Finished processes listed one by one in the metrics, the histograms
+ * cover all of them */
+#define METRICS_EACH 10000
+
+/* Statistics of a CPU, only written by the CPU */
+struct cpu_stat_t {
+    uint64_t busy;    // Slots running a process
+    uint64_t idle;    // Slots waiting for one
+    uint64_t dispatches;    // Time slices started
+    uint64_t switches;    // Time slices of another process than the previous one
+    uint64_t steals;    // Processes taken from a peer, runqueue=percpu
+    uint64_t tlb_hits;
+    uint64_t tlb_misses;
+};
+
+static std::vector<cpu_stat_t> cpu_stat;
+
+/* Next process for [cpu] */
+static std::shared_ptr<pcb_t> next_proc(int cpu) {
+    if (g_PerCpu) {
+        return g_PerCpu->get_proc(cpu);
+    }
+    return g_Scheduler->get_proc();
+}
+
+/* Queue a process preempted on [cpu] */
+static void requeue_proc(int cpu, const std::shared_ptr<pcb_t> &proc) {
+    if (g_PerCpu) {
+        g_PerCpu->put_proc(cpu, proc);
+        return;
+    }
+    g_Scheduler->put_proc(proc);
+}
+
+/* Queue a new process arriving in slot [now]. Its deadline, relative
+ * until then, defaults to the slots its remaining code takes one
+ * instruction per slot */
+static void admit_proc(const std::shared_ptr<pcb_t> &proc, uint64_t now) {
+    proc->sched.arrival = now;
+    if (proc->sched.deadline == 0) {
+        proc->sched.deadline = proc->code.text.size() - proc->pc;
+    }
+    proc->sched.deadline += proc->sched.arrival;
+    if (g_PerCpu) {
+        g_PerCpu->add_proc(proc);
+    } else {
+        g_Scheduler->add_proc(proc);
+    }
+}
+
+/* Account a process dispatched for the first time or finished in slot [now] */
+static void account_proc(pcb_t *proc, bool finished, uint64_t now) {
+    if (!finished) {
+        proc->sched.first_run = now;
+        proc->sched.started = true;
+        return;
+    }
+    proc_stat_t stat{};
+    stat.pid = proc->pid;
+    stat.arrival = proc->sched.arrival;
+    stat.turnaround = now - proc->sched.arrival;
+    stat.waiting = stat.turnaround - std::min(stat.turnaround, proc->sched.ran);
+    stat.response = proc->sched.first_run - proc->sched.arrival;
+    sched_stat.waiting.record(stat.waiting);
+    sched_stat.turnaround.record(stat.turnaround);
+    sched_stat.response.record(stat.response);
+    if (!metrics_path.empty()) {
+        std::unique_lock<std::mutex> lock(sched_stat.lock);
+        if (sched_stat.finished.size() < METRICS_EACH) {
+            sched_stat.finished.push_back(stat);
+        }
+    }
+    uint64_t last = sched_stat.last.load();
+    while (now > last && !sched_stat.last.compare_exchange_weak(last, now)) {
+    }
+}
+
+static uint64_t num_processes;
+static workload_spec_t workload;    // Replaces the process lines if it has images
+static FILE *config_file;    // Positioned on the first process line
+static std::string config_path;
+static std::unique_ptr<arrival_source_t> arrivals;
+
+/* A process read from [arrivals] and not yet admitted */
+struct ld_entry_t {
+    arrival_t arrival;
+    std::shared_ptr<pcb_t> proc;    // Null until parsed
+    bool claimed;    // Some thread is parsing it
+};
+
+/* Processes parsed ahead of their arrival by the loader threads. Process
+ * i, counted in arrival order, is in window[i % LD_WINDOW], so the
+ * threads stay at most LD_WINDOW processes ahead of the admissions and
+ * the memory used does not grow with the number of processes */
+#define LD_WINDOW 64
+
+static struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    ld_entry_t window[LD_WINDOW];
+    uint64_t pulled;    // Processes read from arrivals
+    uint64_t admitted;    // Processes taken by ld_routine
+    bool exhausted;    // arrivals has none left
+    std::vector<std::thread> threads;
+    hdr_histogram_t stalls;    // Nanoseconds ld_routine waited for a process
+} prefetch;
+
+/* Read the next process into the window, with prefetch.lock held.
+ * Return its entry, nullptr if there are no more */
+static ld_entry_t *pull_arrival() {
+    if (prefetch.exhausted) {
+        return nullptr;
+    }
+    ld_entry_t &entry = prefetch.window[prefetch.pulled % LD_WINDOW];
+    if (!arrivals->next(entry.arrival)) {
+        prefetch.exhausted = true;
+        prefetch.changed.notify_all();
+        return nullptr;
+    }
+    entry.proc = nullptr;
+    entry.claimed = false;
+    prefetch.pulled++;
+    return &entry;
+}
+
+static void prefetch_routine() {
+    std::unique_lock<std::mutex> lock(prefetch.lock);
+    while (true) {
+        prefetch.changed.wait(lock, [] {
+            return prefetch.exhausted || prefetch.pulled < prefetch.admitted + LD_WINDOW;
+        });
+        ld_entry_t *entry = pull_arrival();
+        if (entry == nullptr) {
+            return;
+        }
+        entry->claimed = true;
+        lock.unlock();
+        /* Numbered when admitted, the order the threads finish in does not
+         * matter. The entry is not reused before that */
+        std::shared_ptr<pcb_t> proc = load(entry->arrival.path.c_str(), 0);
+        lock.lock();
+        entry->proc = std::move(proc);
+        prefetch.changed.notify_all();
+    }
+}
+
+/* Next process to admit, read from arrivals if the loader threads have
+ * not yet. nullptr if there are no more */
+static const arrival_t *next_arrival() {
+    std::unique_lock<std::mutex> lock(prefetch.lock);
+    if (prefetch.admitted == prefetch.pulled) {
+        ld_entry_t *entry = pull_arrival();
+        return entry ? &entry->arrival : nullptr;
+    }
+    return &prefetch.window[prefetch.admitted % LD_WINDOW].arrival;
+}
+
+/* Take the process next_arrival() returned and move its [arrival] out.
+ * Parse it if no loader thread has started to, wait if one has */
+static std::shared_ptr<pcb_t> take_proc(arrival_t &arrival) {
+    std::unique_lock<std::mutex> lock(prefetch.lock);
+    ld_entry_t &entry = prefetch.window[prefetch.admitted % LD_WINDOW];
+    if (!entry.claimed) {
+        entry.claimed = true;
+        lock.unlock();
+        std::shared_ptr<pcb_t> proc = load(entry.arrival.path.c_str(), 0);
+        lock.lock();
+        entry.proc = std::move(proc);
+    } else if (!entry.proc) {
+        auto begin = std::chrono::steady_clock::now();
+        prefetch.changed.wait(lock, [&entry] { return entry.proc != nullptr; });
+        prefetch.stalls.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count());
+    }
+    std::shared_ptr<pcb_t> proc = std::move(entry.proc);
+    arrival = std::move(entry.arrival);
+    prefetch.admitted++;
+    prefetch.changed.notify_all();
+    return proc;
+}
+
+/* Start the loader threads, which get ahead of the timer before slot 0 */
+static void start_prefetch() {
+    if (loaders < 0) {
+        loaders = std::min<int>(4, std::max<int>(1, (int) std::thread::hardware_concurrency()));
+    }
+    loaders = std::min<uint64_t>(loaders, num_processes);
+    for (int i = 0; i < loaders; i++) {
+        prefetch.threads.emplace_back(prefetch_routine);
+    }
+}
+
+static void stop_prefetch() {
+    for (std::thread &thread: prefetch.threads) {
+        thread.join();
+    }
+    arrivals.reset();
+}
+
+/* Time slice the CPU of this thread is running, for spawn_routine() */
+static thread_local struct {
+    int cpu;
+    uint64_t slot;    // Slot the slice started in
+    uint32_t pc;    // Of the process when the slice started
+} running;
 
 struct cpu_args {
     struct timer_id_t *timer_id;
     int id;
 };
 
+/* Wait for the next quantum once [slots] of the current one have been
+ * busy, return the number of idle slots */
+static uint64_t end_quantum(timer_id_t *timer_id, uint32_t &slots, uint64_t until) {
+    uint64_t idle = idle_slot(timer_id, until) - slots;
+    slots = 0;
+    return idle;
+}
+
 static void cpu_routine(timer_id_t* timer_id, int id) {
     // struct timer_id_t *timer_id = ((struct cpu_args *) args)->timer_id;
     // int id = ((struct cpu_args *) args)->id;
     /* Check for new process in ready queue */
     int time_left = 0;
     std::shared_ptr<pcb_t> proc;
+    cpu_stat_t &stat = cpu_stat[id];
+    uint32_t last_pid = 0;    // Process of the previous time slice
+    uint32_t slots = 0;    // Busy slots of the current quantum
+    /* Translations are tagged by PID, so the TLB survives context switches */
+    tlb_t tlb;
+    memory_t::attach_tlb(&tlb);
     while (true) {
         /* Check the status of current process */
         if (!proc) {
             /* No process is running, then we load new process from
              * ready queue */
-            proc = g_Scheduler.get_proc();
-            if (!proc) {
-                next_slot(timer_id);
+            proc = next_proc(id);
+            if (!proc && !done) {
+                stat.idle += end_quantum(timer_id, slots, NO_WAKE);
                 continue; /* First load failed. skip dummy load */
             }
         } else if (proc->pc == proc->code.text.size()) {
             /* The process has finish it job */
-            printf("\tCPU %d: Processed %2d has finished\n",
-                   id, proc->pid);
-            proc = g_Scheduler.get_proc();
+            trace_record(TRACE_FINISH, current_time() + slots, id, proc->pid);
+            account_proc(proc.get(), true, current_time() + slots);
+            /* Give its frames and swap slots back */
+            g_Memory.release(proc.get());
+            proc = next_proc(id);
             time_left = 0;
         } else if (time_left == 0) {
             /* The process has done its job in current time slot */
-            printf("\tCPU %d: Put process %2d to run queue\n",
-                   id, proc->pid);
-#ifdef MLQ_SCHED
-            g_Scheduler.add_proc(proc);
-#else
-            g_Scheduler.put_proc(proc);
-#endif
-            proc = g_Scheduler.get_proc();
+            trace_record(TRACE_PUT, current_time() + slots, id, proc->pid);
+            requeue_proc(id, proc);
+            proc = next_proc(id);
         }
 
         /* Recheck process status after loading new process */
         if (!proc && done) {
             /* No process to run, exit */
-            printf("\tCPU %d stopped\n", id);
+            trace_record(TRACE_STOP, current_time() + slots, id, 0);
+            stat.steals = g_PerCpu ? g_PerCpu->steals(id) : 0;
+            stat.tlb_hits = tlb.hits;
+            stat.tlb_misses = tlb.misses;
+            if (!verbose && metrics_path.empty()) {
+                break;
+            }
+            fprintf(stderr, "\tCPU %d TLB: %lu hits, %lu misses\n",
+                    id, tlb.hits, tlb.misses);
+            fprintf(stderr, "\tCPU %d: %lu busy, %lu idle slots (%.1f%% utilization), %lu steals\n",
+                    id, stat.busy, stat.idle,
+                    stat.busy + stat.idle ? 100.0 * stat.busy / (stat.busy + stat.idle) : 0.0, stat.steals);
             break;
         } else if (!proc) {
             /* There may be new processes to run in
              * next time slots, just skip current slot */
-            next_slot(timer_id);
+            stat.idle += end_quantum(timer_id, slots, NO_WAKE);
             continue;
         } else if (time_left == 0) {
-            printf("\tCPU %d: Dispatched process %2d\n",
-                   id, proc->pid);
+            trace_record(TRACE_DISPATCH, current_time() + slots, id, proc->pid);
+            if (!proc->sched.started) {
+                account_proc(proc.get(), false, current_time() + slots);
+            }
+            stat.dispatches += 1;
+            stat.switches += proc->pid != last_pid;
+            last_pid = proc->pid;
             time_left = time_slot;
         }
 
-        /* Run current process */
-        run(proc.get());
-        time_left--;
-        next_slot(timer_id);
+        /* Run current process, one instruction per time slot up to the end
+         * of the quantum, or the whole slice as a single slot with the fast
+         * timer. A process finishing or preempted before the quantum ends
+         * leaves the rest of it to the next one, as slot by slot */
+        running = {id, current_time() + slots, proc->pc};
+        uint32_t ran = run_slice(proc.get(), fast_timer() ? time_left : std::min<uint32_t>(time_left, quantum - slots),
+                                 engine);
+        time_left -= ran;
+        uint32_t used = fast_timer() ? 1 : ran;
+        stat.busy += used;
+        proc->sched.ran += used;
+        slots += used;
+        if (slots == quantum) {
+            end_quantum(timer_id, slots, 0);
+        }
     }
+    memory_t::attach_tlb(nullptr);
     detach_event(timer_id);
     pthread_exit(nullptr);
 }
 
-static void ld_routine(timer_id_t* timer_id) {
-    // auto *timer_id = (struct timer_id_t *) args;
-    int i = 0;
-    while (i < num_processes) {
-        std::shared_ptr<pcb_t> proc = load(ld_processes.path[i]);
-#ifdef MLQ_SCHED
-        proc->prio = ld_processes.prio[i];
-#endif
-        while (current_time() < ld_processes.start_time[i]) {
-            next_slot(timer_id);
+/* Processes created by FORK join the ready queue right away, in the slot
+ * the FORK ran in. The child resumes after the FORK, so its pc tells how
+ * far into the slice that was */
+static void spawn_routine(std::shared_ptr<pcb_t> child) {
+    uint64_t now = running.slot + (fast_timer() ? 0 : child->pc - 1 - running.pc);
+    trace_record(TRACE_FORK, now, running.cpu, child->pid);
+    admit_proc(child, now);
+}
+
+/*
+ * Admit the processes arriving in the slot, or quantum, starting at [now].
+ * Run by the timer before any CPU runs that slot, so a process is ready
+ * in its arrival slot whichever thread gets there first. At most one
+ * process arrives per slot, as when a loader device admitted them.
+ * Return the slot of the next arrival
+ */
+static uint64_t ld_routine(uint64_t now) {
+    static uint64_t slot = 0;    // First slot the next process may arrive in
+    const arrival_t *next;
+    while ((next = next_arrival()) != nullptr) {
+        slot = std::max<uint64_t>(slot, next->start_time);
+        if (slot >= now + quantum) {
+            return slot;
         }
-#ifdef MLQ_SCHED
-        printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
-               ld_processes.path[i], proc->pid, ld_processes.prio[i]);
-#else
-        printf("\tLoaded a process at %s, PID: %d\n",
-               ld_processes.path[i], proc->pid);
-#endif
-        g_Scheduler.add_proc(proc);
-        free(ld_processes.path[i]);
-        i++;
-        next_slot(timer_id);
-    }
-    free(ld_processes.path);
-    free(ld_processes.start_time);
+        arrival_t arrival;
+        std::shared_ptr<pcb_t> proc = take_proc(arrival);
+        proc->pid = new_pid();
+        proc->prio = arrival.prio;
+        proc->sched.deadline = arrival.deadline;
+        trace_record(TRACE_LOAD, now, 0, proc->pid, arrival.prio, arrival.path.c_str());
+        admit_proc(proc, now);
+        slot++;
+    }
     done = 1;
-    detach_event(timer_id);
-    pthread_exit(nullptr);
+    return NO_WAKE;
 }
 
+/* Apply a key=value option from the config file */
+static void set_option(const std::string &option) {
+    size_t split = option.find('=');
+    if (split == std::string::npos) {
+        printf("Invalid option: %s\n", option.c_str());
+        exit(1);
+    }
+    std::string key = option.substr(0, split);
+    std::string value = option.substr(split + 1);
+    if (key == "engine") {
+        if (value != "switch" && value != "threaded") {
+            printf("Invalid engine: %s (expected switch or threaded)\n", value.c_str());
+            exit(1);
+        }
+        engine = value == "threaded" ? ENGINE_THREADED : ENGINE_SWITCH;
+        return;
+    }
+    if (key == "runqueue") {
+        if (value != "global" && value != "percpu") {
+            printf("Invalid runqueue: %s (expected global or percpu)\n", value.c_str());
+            exit(1);
+        }
+        percpu = value == "percpu";
+        return;
+    }
+    if (key == "policy") {
+        if (!make_policy(value)) {
+            printf("Invalid policy: %s (expected mlq, lockfree, twoqueue, cfs, lottery, stride or edf)\n",
+                   value.c_str());
+            exit(1);
+        }
+        policy = value;
+        return;
+    }
+    if (key == "tolerance") {
+        tolerance = atoi(value.c_str());
+        return;
+    }
+    if (key == "timer") {
+        if (value != "tick" && value != "fast") {
+            printf("Invalid timer: %s (expected tick or fast)\n", value.c_str());
+            exit(1);
+        }
+        set_fast_timer(value == "fast");
+        return;
+    }
+    if (key == "batch") {
+        quantum = atoi(value.c_str());
+        if (quantum == 0) {
+            printf("Invalid batch: %s (expected a number of slots)\n", value.c_str());
+            exit(1);
+        }
+        return;
+    }
+    if (key == "trace") {
+        trace_path = value;
+        return;
+    }
+    if (key == "loaders") {
+        loaders = atoi(value.c_str());
+        return;
+    }
+    if (key == "metrics") {
+        metrics_path = value;
+        return;
+    }
+    if (key == "verbose") {
+        verbose = atoi(value.c_str()) != 0;
+        return;
+    }
+    if (key == "idle") {
+        if (value != "tick" && value != "skip") {
+            printf("Invalid idle: %s (expected tick or skip)\n", value.c_str());
+            exit(1);
+        }
+        set_skip_idle(value == "skip");
+        return;
+    }
+    if (key == "processes") {
+        num_processes = strtoull(value.c_str(), nullptr, 10);
+        return;
+    }
+    if (mem_config.set(key.c_str(), value.c_str()) == 0 || workload.set(key.c_str(), value.c_str()) == 0) {
+        return;
+    }
+    printf("Unknown option: %s\n", key.c_str());
+    exit(1);
+}
+
+/* The first line of the config may go on with options after the three
+ * numbers, e.g. "2 4 8 ram=1G page=4K levels=3" */
+static void read_options(FILE *file) {
+    std::string option;
+    int c;
+    do {
+        c = fgetc(file);
+        if (c == EOF || isspace(c)) {
+            if (!option.empty()) {
+                set_option(option);
+                option.clear();
+            }
+        } else {
+            option.push_back((char) c);
+        }
+    } while (c != EOF && c != '\n');
+}
+
+/* Read the first line of the config file. The process lines are read
+ * as the processes are loaded, see config_arrivals() */
 static void read_config(const char *path) {
-    FILE *file;
-    if ((file = fopen(path, "r")) == nullptr) {
+    if ((config_file = fopen(path, "r")) == nullptr) {
         printf("Cannot find configure file at %s\n", path);
         exit(1);
     }
-    fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
-    ld_processes.path = (char **) malloc(sizeof(char *) * num_processes);
-    ld_processes.start_time = (unsigned long *)
-        malloc(sizeof(unsigned long) * num_processes);
-#ifdef MLQ_SCHED
-    ld_processes.prio = (unsigned long *)
-        malloc(sizeof(unsigned long) * num_processes);
-#endif
-    int i;
-    for (i = 0; i < num_processes; i++) {
-        ld_processes.path[i] = (char *) malloc(sizeof(char) * 100);
-        ld_processes.path[i][0] = '\0';
-        strcat(ld_processes.path[i], "input/proc/");
-        char proc[100];
-#ifdef MLQ_SCHED
-        fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
-#else
-        fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
-#endif
-        strcat(ld_processes.path[i], proc);
+    config_path = path;
+    if (fscanf(config_file, "%d %d %lu", &time_slot, &num_cpus, &num_processes) != 3) {
+        printf("Invalid configure file %s\n", path);
+        exit(1);
+    }
+    read_options(config_file);
+}
+
+/* Save every metric to [path] as a JSON object */
+static void write_metrics(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == nullptr) {
+        printf("Cannot open metrics file %s\n", path);
+        exit(1);
+    }
+    fprintf(out, "{\n  \"policy\": \"%s\",\n  \"time_slot\": %d,\n  \"batch\": %u,\n  \"slots\": %lu,\n",
+            policy.c_str(), time_slot, quantum, sched_stat.last.load());
+
+    fprintf(out, "  \"processes\": {\n    \"finished\": %lu,\n", sched_stat.turnaround.count());
+    fprintf(out, "    \"waiting\": ");
+    sched_stat.waiting.json(out);
+    fprintf(out, ",\n    \"turnaround\": ");
+    sched_stat.turnaround.json(out);
+    fprintf(out, ",\n    \"response\": ");
+    sched_stat.response.json(out);
+    fprintf(out, ",\n    \"each\": [");
+    std::sort(sched_stat.finished.begin(), sched_stat.finished.end(),
+              [](const proc_stat_t &a, const proc_stat_t &b) { return a.pid < b.pid; });
+    for (size_t i = 0; i < sched_stat.finished.size(); i++) {
+        const proc_stat_t &it = sched_stat.finished[i];
+        fprintf(out, "%s\n      {\"pid\": %u, \"arrival\": %lu, \"waiting\": %lu, \"turnaround\": %lu, "
+                     "\"response\": %lu}",
+                i ? "," : "", it.pid, it.arrival, it.waiting, it.turnaround, it.response);
     }
+    fprintf(out, "\n    ]\n  },\n");
+
+    fprintf(out, "  \"cpus\": [");
+    uint64_t switches = 0;
+    for (size_t i = 0; i < cpu_stat.size(); i++) {
+        const cpu_stat_t &it = cpu_stat[i];
+        switches += it.switches;
+        fprintf(out, "%s\n    {\"id\": %lu, \"busy\": %lu, \"idle\": %lu, \"utilization\": %.4f, "
+                     "\"dispatches\": %lu, \"context_switches\": %lu, \"steals\": %lu, "
+                     "\"tlb_hits\": %lu, \"tlb_misses\": %lu}",
+                i ? "," : "", i, it.busy, it.idle, it.busy + it.idle ? (double) it.busy / (it.busy + it.idle) : 0.0,
+                it.dispatches, it.switches, it.steals, it.tlb_hits, it.tlb_misses);
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"scheduler\": {\n    \"context_switches\": %lu,\n    \"lock_wait_ns\": ", switches);
+    sched_lock_waits().json(out);
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"loader\": {\n    \"threads\": %zu,\n    \"cached_loads\": %lu,\n    \"stall_ns\": ",
+            prefetch.threads.size(), cached_loads());
+    prefetch.stalls.json(out);
+    fprintf(out, "\n  },\n");
+
+    paging_stat_t paging = g_Memory.paging_stat();
+    fprintf(out, "  \"memory\": {\n    \"alloc_failures\": %lu,\n    \"alloc_ns\": ", g_Memory.alloc_failures());
+    g_Memory.alloc_latency().json(out);
+    fprintf(out, ",\n    \"page_faults\": %lu,\n    \"swap_ins\": %lu,\n    \"swap_outs\": %lu\n  }\n}\n",
+            paging.faults, paging.swap_ins, paging.swap_outs);
+    fclose(out);
 }
 
 int main(int argc, char *argv[]) {
     /* Read config */
-    if (argc != 2) {
-        printf("Usage: os [path to configure file]\n");
+    if (argc < 2) {
+        printf("Usage: os [path to configure file] [option=value]...\n");
         return 1;
     }
-    char path[100];
-    path[0] = '\0';
-    strcat(path, "input/");
-    strcat(path, argv[1]);
-    read_config(path);
+    read_config((std::string("input/") + argv[1]).c_str());
+    /* Options on the command line override the config file's */
+    for (int option = 2; option < argc; option++) {
+        set_option(argv[option]);
+    }
+    if (workload.images.empty()) {
+        arrivals = config_arrivals(config_file, config_path.c_str(), num_processes);
+    } else {
+        fclose(config_file);
+        arrivals = generated_arrivals(workload, num_processes);
+    }
+    g_Memory.configure(mem_config);
+    set_spawn_handler(spawn_routine);
+    if (quantum > 1 && fast_timer()) {
+        printf("batch=%u does not combine with timer=fast\n", quantum);
+        exit(1);
+    }
+    set_timer_quantum(quantum);
+    g_Scheduler = make_policy(policy);
+    if (percpu && policy != "mlq") {
+        printf("runqueue=percpu only supports policy=mlq\n");
+        exit(1);
+    }
+    cpu_stat.resize(num_cpus);
+    if (percpu) {
+        g_PerCpu = std::make_unique<percpu_scheduler_t>(num_cpus, tolerance);
+    }
 
     /* Memory leaks here */
     // auto *cpu = (pthread_t *) malloc(num_cpus * sizeof(pthread_t));
     // auto *args = (struct cpu_args *) malloc(sizeof(struct cpu_args) * num_cpus);
-    // pthread_t ld;
     std::vector<std::thread> cpu;
     std::vector<timer_id_t*> args;
-    std::thread ld;
 
     /* Init timer */
     int i;
     for (i = 0; i < num_cpus; i++) {
         args.push_back(attach_event());
     }
-    struct timer_id_t *ld_event = attach_event();
+    if (!trace_path.empty()) {
+        trace_open(trace_path.c_str());
+    } else if (quantum > 1) {
+        trace_hold();
+    }
+    start_prefetch();
+    set_tick_handler(ld_routine);
     start_timer();
 
-    /* Run CPU and loader */
-    ld = std::thread(ld_routine, ld_event);
+    /* Run CPU, processes are loaded by the timer */
     for (i = 0; i < num_cpus; i++) {
         cpu.emplace_back(cpu_routine, args.at(i), i);
     }
 
-    /* Wait for CPU and loader finishing */
+    /* Wait for CPU finishing */
     for (i = 0; i < num_cpus; i++) {
         cpu.at(i).join();
     }
-    ld.join();
 
     /* Stop timer */
     stop_timer();
+    stop_prefetch();
+    trace_close();
 
+    uint64_t finished = sched_stat.turnaround.count();
+    if (finished > 0) {
+        fprintf(stderr, "Policy %s: %lu processes in %lu slots (%.3f per slot), "
+                        "turnaround %.1f, response %.1f (max %lu)\n",
+                policy.c_str(), finished, sched_stat.last.load(), (double) finished / sched_stat.last,
+                sched_stat.turnaround.mean(), sched_stat.response.mean(), sched_stat.response.max());
+    }
+    if (!metrics_path.empty()) {
+        write_metrics(metrics_path.c_str());
+    }
+
+    if (mem_config.demand) {
+        paging_stat_t paging = g_Memory.paging_stat();
+        fprintf(stderr, "Page faults: %lu, swap-ins: %lu, swap-outs: %lu\n",
+                paging.faults, paging.swap_ins, paging.swap_outs);
+    }
     return 0;
 
 }
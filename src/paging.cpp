@@ -5,17 +5,56 @@
 
 extern memory_t g_Memory;
 
+/* Processes created by FORK, run after their parent. They stay alive
+ * until the dump, which shows the frames they share */
+static std::vector<std::shared_ptr<pcb_t>> children;
+
+static void spawn(std::shared_ptr<pcb_t> child) {
+	children.push_back(child);
+}
+
 int main(int argc, char ** argv) {
 	if (argc < 2) {
 		printf("Cannot find input process\n");
 		exit(1);
 	}
+	/* Memory options, e.g. ram=4G page=4K levels=4 */
+	mem_config_t mem_config;
+	for (int opt = 2; opt < argc; opt++) {
+		char key[64];
+		const char *value = strchr(argv[opt], '=');
+		if (value == nullptr || value - argv[opt] >= (long) sizeof(key)) {
+			printf("Invalid option: %s\n", argv[opt]);
+			exit(1);
+		}
+		snprintf(key, sizeof(key), "%.*s", (int) (value - argv[opt]), argv[opt]);
+		if (mem_config.set(key, value + 1)) {
+			printf("Unknown option: %s\n", key);
+			exit(1);
+		}
+	}
+	g_Memory.configure(mem_config);
+	set_spawn_handler(spawn);
 	std::shared_ptr<pcb_t> proc = load(argv[1]);
+	tlb_t tlb;
+	memory_t::attach_tlb(&tlb);
 	unsigned int i;
 	for (i = 0; i < proc->code.text.size(); i++) {
 		run(proc.get());
 	}
+	for (size_t next = 0; next < children.size(); next++) {
+		std::shared_ptr<pcb_t> child = children[next];
+		while (child->pc < child->code.text.size()) {
+			run(child.get());
+		}
+	}
+	memory_t::attach_tlb(nullptr);
     g_Memory.dump();
+	if (mem_config.demand) {
+		paging_stat_t paging = g_Memory.paging_stat();
+		printf("Page faults: %lu, swap-ins: %lu, swap-outs: %lu\n",
+		       paging.faults, paging.swap_ins, paging.swap_outs);
+	}
 	return 0;
 }
 
@@ -1,12 +1,80 @@
 #include "queue.h"
 
+queue_t::queue_t(queue_t &&other) noexcept {
+    *this = std::move(other);
+}
+
+queue_t &queue_t::operator=(queue_t &&other) noexcept {
+    std::swap(_root, other._root);
+    std::swap(_size, other._size);
+    std::swap(_seq, other._seq);
+    return *this;
+}
+
+queue_t::~queue_t() {
+    /* Iteratively, a long chain of owners would overflow the stack */
+    while (!empty()) {
+        dequeue();
+    }
+}
+
+pcb_t *queue_t::meld(pcb_t *a, pcb_t *b) {
+    if (a == nullptr) {
+        return b;
+    }
+    if (b == nullptr) {
+        return a;
+    }
+    if (before(b, a)) {
+        std::swap(a, b);
+    }
+    b->ready.sibling = a->ready.child;
+    a->ready.child = b;
+    return a;
+}
+
+/*
+ * Standard two-pass pairing: meld the children two by two from left to
+ * right, then meld the pairs from right to left. The pairs are chained in
+ * reverse through their sibling link, so no extra memory is needed
+ */
+pcb_t *queue_t::merge_pairs(pcb_t *first) {
+    pcb_t *pairs = nullptr;
+    while (first != nullptr) {
+        pcb_t *a = first;
+        pcb_t *b = a->ready.sibling;
+        first = b != nullptr ? b->ready.sibling : nullptr;
+        a->ready.sibling = nullptr;
+        if (b != nullptr) {
+            b->ready.sibling = nullptr;
+        }
+        pcb_t *pair = meld(a, b);
+        pair->ready.sibling = pairs;
+        pairs = pair;
+    }
+    pcb_t *root = nullptr;
+    while (pairs != nullptr) {
+        pcb_t *next = pairs->ready.sibling;
+        pairs->ready.sibling = nullptr;
+        root = meld(root, pairs);
+        pairs = next;
+    }
+    return root;
+}
+
 void queue_t::enqueue(std::shared_ptr<pcb_t> proc) {
     /* Enqueue new process */
-    if (q.size() == MAX_QUEUE_SIZE) {
-        perror("Queue overflow while enqueue-ing\n");
+    if (proc->ready.self) {
+        perror("Process already in a queue while enqueue-ing\n");
         return;
     }
-    q.push(proc);
+    pcb_t *node = proc.get();
+    node->ready.child = nullptr;
+    node->ready.sibling = nullptr;
+    node->ready.seq = _seq++;
+    node->ready.self = std::move(proc);
+    _root = meld(_root, node);
+    _size += 1;
 }
 
 std::shared_ptr<pcb_t> queue_t::dequeue() {
@@ -15,11 +83,62 @@ std::shared_ptr<pcb_t> queue_t::dequeue() {
         perror("Dequeue-ing from empty queue\n");
         return nullptr;
     }
-    std::shared_ptr<pcb_t> top = q.top();
-    q.pop();
-    return top;
+    pcb_t *top = _root;
+    _root = merge_pairs(top->ready.child);
+    top->ready.child = nullptr;
+    _size -= 1;
+    return std::move(top->ready.self);
+}
+
+mpmc_queue_t::mpmc_queue_t(size_t capacity) : _cells(new cell_t[capacity]), _mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++) {
+        _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool mpmc_queue_t::try_enqueue(const std::shared_ptr<pcb_t> &proc) {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    while (true) {
+        cell_t &cell = _cells[pos & _mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            /* The cell is free in this lap, claim it */
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.proc = proc;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* Still holds the process of the previous lap */
+            return false;
+        } else {
+            pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+std::shared_ptr<pcb_t> mpmc_queue_t::try_dequeue() {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    while (true) {
+        cell_t &cell = _cells[pos & _mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                std::shared_ptr<pcb_t> proc = std::move(cell.proc);
+                /* Free for the producer of the next lap */
+                cell.seq.store(pos + _mask + 1, std::memory_order_release);
+                return proc;
+            }
+        } else if (diff < 0) {
+            return nullptr;
+        } else {
+            pos = _head.load(std::memory_order_relaxed);
+        }
+    }
 }
 
-bool queue_t::empty() {
-    return q.empty();
+bool mpmc_queue_t::empty() const {
+    return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
 }
@@ -1,21 +1,24 @@
 #include "schedu.h"
 
-#ifdef MLQ_SCHED
+static hdr_histogram_t lock_waits;
+
+hdr_histogram_t &sched_lock_waits() {
+    return lock_waits;
+}
+
 void mlq_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
-    std::unique_lock lock(m_Lock);
+    std::unique_lock<std::mutex> lock = metered_lock(m_Lock, lock_waits);
     /* O(log n) */
-    m_q_Ready[(MAX_PRIO - 1) - proc->prio].enqueue(proc);
-#ifdef OPTIMIZED_SCH
-    m_q_Access.push(proc->prio);
-#endif
+    m_q_Ready[proc->prio].enqueue(proc);
+    m_Levels.set(proc->prio);
 }
 
 /*
  * Processes running on the higher priority queues
  * have absolute overridability over process of lower priority
  *
- * NAIVE APPROACH:      From highest priority queues to lowest, if the previous one is
- *                      empty, go to lower priority queues, then take away top priority process from that queue
+ * NAIVE APPROACH:      (Former one, see bench prio) From the lowest level to the highest, if one is
+ *                      empty, go to the next one, then take away top priority process from that queue
  *
  *      DISADVANTAGE:   Go through the whole queue stack every process extraction
  *
@@ -25,44 +28,100 @@ void mlq_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
  *                      |
  *                      |__> Generally O(n) : n = number of levels
  *
- * OPTIMIZATION:        Add another standalone priority queue
- *                      Added processes's prio level (uint32_t) go into that queue, priority comparison are done based on the ASSIGNED QUEUE LEVEL (prio)
- *                      Processes of highest priority goes in front
- *                      Next time get_proc() is accessed, pop() from the priority queue to get the level where most prioritize process just got put into
- *                      then queue[level].pop() to get the level
+ * OPTIMIZATION:        Keep a bitmap of the levels holding processes, set on enqueue and
+ *                      cleared when a dequeue drains the level
+ *                      The lowest set bit is found with two count-trailing-zeros, one on
+ *                      the summary word and one on the word it points to
  *
- *      WHY:            Avoid traversal of queue levels, reduces the complexity to less than O(n)
+ *      WHY:            Avoid traversal of queue levels, O(1) on both add_proc() and get_proc()
  *
- *      TRADEOFF:       More memory. uint32_t generally have an allocated size of 4 byte, at any given point of 10000 process, it consumes 40KB more than the naive approach
+ *      TRADEOFF:       72 bytes. A heap of pushed levels (the former approach) grew with
+ *                      every add_proc() and could pop a level already drained, returning
+ *                      nullptr while other levels still had processes
  */
 std::shared_ptr<pcb_t> mlq_scheduler_t::get_proc() {
-    std::unique_lock lock(m_Lock);
-    /* Naive approach */
-    /* Avoid using mlq_scheduler_t.empty(), which makes naive approach O(2*n) */
-#ifdef OPTIMIZED_SCH
+    std::unique_lock<std::mutex> lock = metered_lock(m_Lock, lock_waits);
     /* O(1) */
-    if (!m_q_Access.empty()) {
-        uint32_t prioritized_next_level = m_q_Access.top();
-        /* O(log n) : n is the number of processes */
-        m_q_Access.pop();
-        if (!m_q_Ready[(MAX_PRIO - 1) - prioritized_next_level].empty()) {
-            /* O(log n) : n is the size of this level queue */
-            return m_q_Ready[(MAX_PRIO - 1) - prioritized_next_level].dequeue();
+    uint32_t prioritized_next_level = m_Levels.first();
+    if (prioritized_next_level < MAX_PRIO) {
+        queue_t &level = m_q_Ready[prioritized_next_level];
+        /* O(log n) : n is the size of this level queue */
+        std::shared_ptr<pcb_t> proc = level.dequeue();
+        if (level.empty()) {
+            m_Levels.clear(prioritized_next_level);
         }
+        return proc;
+    }
+    return nullptr;
+}
+
+lockfree_mlq_scheduler_t::~lockfree_mlq_scheduler_t() {
+    for (std::atomic<lockfree_level_t *> &level: m_q_Ready) {
+        delete level.load();
     }
-#else
-    for (uint32_t i = 0; i < MAX_PRIO; i += 1) {
-        if (!m_q_Ready[i].empty()) {
-            return m_q_Ready[i].dequeue();
+}
+
+void lockfree_mlq_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    uint32_t prio = proc->prio;
+    lockfree_level_t *level = m_q_Ready[prio].load(std::memory_order_acquire);
+    if (level == nullptr) {
+        auto *fresh = new lockfree_level_t;
+        if (m_q_Ready[prio].compare_exchange_strong(level, fresh, std::memory_order_acq_rel)) {
+            level = fresh;
+        } else {
+            /* Another CPU created it first */
+            delete fresh;
+        }
+    }
+    /* Spill behind the processes already spilled to keep the level FIFO */
+    if (level->spilled.load(std::memory_order_acquire) > 0 || !level->ring.try_enqueue(proc)) {
+        std::unique_lock<std::mutex> lock = metered_lock(level->spill_lock, lock_waits);
+        level->spill.push_back(proc);
+        level->spilled.fetch_add(1, std::memory_order_release);
+    }
+    m_Levels[prio / 64].fetch_or(1ULL << (63 - prio % 64), std::memory_order_release);
+}
+
+/*
+ * A set bit only means the level may hold processes. A CPU finding the
+ * level drained clears the bit, then sets it back if a process was
+ * enqueued in the meantime: the enqueuer may have set the bit before it
+ * was cleared
+ */
+std::shared_ptr<pcb_t> lockfree_mlq_scheduler_t::get_proc() {
+    uint32_t word = 0;
+    while (word < MAX_PRIO / 64) {
+        uint64_t bits = m_Levels[word].load(std::memory_order_acquire);
+        if (bits == 0) {
+            word++;
+            continue;
+        }
+        uint32_t prio = word * 64 + std::countl_zero(bits);
+        lockfree_level_t *level = m_q_Ready[prio].load(std::memory_order_acquire);
+        std::shared_ptr<pcb_t> proc = level->ring.try_dequeue();
+        if (proc) {
+            return proc;
+        }
+        if (level->spilled.load(std::memory_order_acquire) > 0) {
+            std::unique_lock<std::mutex> lock = metered_lock(level->spill_lock, lock_waits);
+            if (!level->spill.empty()) {
+                proc = std::move(level->spill.front());
+                level->spill.pop_front();
+                level->spilled.fetch_sub(1, std::memory_order_release);
+                return proc;
+            }
+        }
+        uint64_t bit = 1ULL << (63 - prio % 64);
+        m_Levels[word].fetch_and(~bit, std::memory_order_acq_rel);
+        if (!level->empty()) {
+            m_Levels[word].fetch_or(bit, std::memory_order_release);
         }
     }
-#endif
     return nullptr;
 }
-#else
 
 std::shared_ptr<pcb_t> scheduler_t::get_proc() {
-    std::unique_lock<std::mutex> lock(m_Lock);
+    std::unique_lock<std::mutex> lock = metered_lock(m_Lock, lock_waits);
     if (m_q_Ready.empty()) {
         if (m_q_Run.empty()) {
             return nullptr;
@@ -73,13 +132,227 @@ std::shared_ptr<pcb_t> scheduler_t::get_proc() {
 }
 
 void scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
-    std::unique_lock<std::mutex> lock(m_Lock);
+    std::unique_lock<std::mutex> lock = metered_lock(m_Lock, lock_waits);
     m_q_Ready.enqueue(proc);
 }
 
 void scheduler_t::put_proc(const std::shared_ptr<pcb_t> &proc) {
-    std::unique_lock<std::mutex> lock(m_Lock);
+    std::unique_lock<std::mutex> lock = metered_lock(m_Lock, lock_waits);
     m_q_Run.enqueue(proc);
 }
 
-#endif
+std::unique_ptr<sched_policy_t> make_policy(const std::string &name) {
+    if (name == "mlq") {
+        return std::make_unique<mlq_scheduler_t>();
+    } else if (name == "lockfree") {
+        return std::make_unique<lockfree_mlq_scheduler_t>();
+    } else if (name == "twoqueue") {
+        return std::make_unique<scheduler_t>();
+    } else if (name == "cfs") {
+        return std::make_unique<cfs_scheduler_t>();
+    } else if (name == "lottery") {
+        /* Fixed seed, runs of the same input draw the same tickets */
+        return std::make_unique<lottery_scheduler_t>(1);
+    } else if (name == "stride") {
+        return std::make_unique<stride_scheduler_t>();
+    } else if (name == "edf") {
+        return std::make_unique<edf_scheduler_t>();
+    }
+    return nullptr;
+}
+
+/* Weight of nice -20..19, nice 0 is 1024 and each step is about 25% */
+static const uint32_t nice_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+std::shared_ptr<pcb_t> cfs_scheduler_t::get_proc() {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    if (_tree.empty()) {
+        return nullptr;
+    }
+    auto leftmost = _tree.begin();
+    std::shared_ptr<pcb_t> proc = std::move(leftmost->second);
+    _min_vruntime = std::max(_min_vruntime, leftmost->first);
+    _tree.erase(leftmost);
+    return proc;
+}
+
+void cfs_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    proc->sched.vruntime = std::max(proc->sched.vruntime, _min_vruntime);
+    _tree.emplace(proc->sched.vruntime, proc);
+}
+
+void cfs_scheduler_t::put_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    uint64_t weight = nice_weight[std::min<uint32_t>(proc->prio, 39)];
+    proc->sched.vruntime += (uint64_t) SCHED_SCALE * 1024 / weight;
+    _tree.emplace(proc->sched.vruntime, proc);
+}
+
+static uint64_t tickets(const pcb_t *proc) {
+    return MAX_PRIO - std::min<uint32_t>(proc->prio, MAX_PRIO - 1);
+}
+
+std::shared_ptr<pcb_t> lottery_scheduler_t::get_proc() {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    if (_ready.empty()) {
+        return nullptr;
+    }
+    uint64_t winner = _rng() % _tickets;
+    size_t i = 0;
+    while (winner >= tickets(_ready[i].get())) {
+        winner -= tickets(_ready[i].get());
+        i++;
+    }
+    std::shared_ptr<pcb_t> proc = std::move(_ready[i]);
+    _ready[i] = std::move(_ready.back());
+    _ready.pop_back();
+    _tickets -= tickets(proc.get());
+    return proc;
+}
+
+void lottery_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    _ready.push_back(proc);
+    _tickets += tickets(proc.get());
+}
+
+std::shared_ptr<pcb_t> stride_scheduler_t::get_proc() {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    if (_ready.empty()) {
+        return nullptr;
+    }
+    auto first = _ready.begin();
+    std::shared_ptr<pcb_t> proc = std::move(first->second);
+    _global_pass = std::max(_global_pass, first->first);
+    _ready.erase(first);
+    return proc;
+}
+
+void stride_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    /* Joining at the current pass, a newcomer gets no credit for the time
+     * it was not there */
+    proc->sched.vruntime = std::max(proc->sched.vruntime, _global_pass);
+    _ready.emplace(proc->sched.vruntime, proc);
+}
+
+void stride_scheduler_t::put_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    proc->sched.vruntime += SCHED_SCALE / tickets(proc.get());
+    _ready.emplace(proc->sched.vruntime, proc);
+}
+
+std::shared_ptr<pcb_t> edf_scheduler_t::get_proc() {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    if (_ready.empty()) {
+        return nullptr;
+    }
+    std::shared_ptr<pcb_t> proc = std::move(_ready.begin()->second);
+    _ready.erase(_ready.begin());
+    return proc;
+}
+
+void edf_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(_lock, lock_waits);
+    _ready.emplace(proc->sched.deadline, proc);
+}
+
+percpu_scheduler_t::percpu_scheduler_t(int cpus, uint32_t tolerance) : _cpus(cpus), _tolerance(tolerance) {}
+
+void percpu_scheduler_t::push(local_t &cpu, const std::shared_ptr<pcb_t> &proc) {
+    std::unique_lock<std::mutex> lock = metered_lock(cpu.lock, lock_waits);
+    cpu.levels[proc->prio].enqueue(proc);
+    cpu.used.set(proc->prio);
+    cpu.size.store(cpu.size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (proc->prio < cpu.best.load(std::memory_order_relaxed)) {
+        cpu.best.store(proc->prio, std::memory_order_relaxed);
+    }
+}
+
+std::shared_ptr<pcb_t> percpu_scheduler_t::pop(local_t &cpu) {
+    std::unique_lock<std::mutex> lock = metered_lock(cpu.lock, lock_waits);
+    uint32_t prio = cpu.used.first();
+    if (prio == MAX_PRIO) {
+        return nullptr;
+    }
+    std::shared_ptr<pcb_t> proc = cpu.levels[prio].dequeue();
+    if (cpu.levels[prio].empty()) {
+        cpu.used.clear(prio);
+    }
+    cpu.size.store(cpu.size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    cpu.best.store(cpu.used.first(), std::memory_order_relaxed);
+    return proc;
+}
+
+void percpu_scheduler_t::add_proc(const std::shared_ptr<pcb_t> &proc) {
+    /* Start the search at a rotating CPU so ties do not all go to CPU 0 */
+    size_t start = _next.fetch_add(1, std::memory_order_relaxed) % _cpus.size();
+    size_t target = start;
+    for (size_t i = 0; i < _cpus.size(); i++) {
+        size_t cpu = (start + i) % _cpus.size();
+        if (_cpus[cpu].size.load(std::memory_order_relaxed) < _cpus[target].size.load(std::memory_order_relaxed)) {
+            target = cpu;
+        }
+    }
+    push(_cpus[target], proc);
+}
+
+void percpu_scheduler_t::put_proc(int cpu, const std::shared_ptr<pcb_t> &proc) {
+    push(_cpus[cpu], proc);
+}
+
+/*
+ * The published [best] and [size] of the peers are read without their
+ * lock, so the choice may be stale. pop() rechecks under the lock and the
+ * CPU falls back on the next option when the queue it picked was drained
+ */
+std::shared_ptr<pcb_t> percpu_scheduler_t::get_proc(int cpu) {
+    local_t &mine = _cpus[cpu];
+    while (true) {
+        /* Processes within [_tolerance] of the best prio of every CPU may
+         * run here, our own first, then those of the busiest peer */
+        uint32_t best = mine.best.load(std::memory_order_relaxed);    // MAX_PRIO if empty
+        uint32_t global = best;
+        for (local_t &peer: _cpus) {
+            global = std::min(global, peer.best.load(std::memory_order_relaxed));
+        }
+        if (global == MAX_PRIO) {
+            return nullptr;
+        }
+        if (best <= global + _tolerance) {
+            std::shared_ptr<pcb_t> proc = pop(mine);
+            if (proc) {
+                return proc;
+            }
+            continue;    // A peer stole it meanwhile
+        }
+        int busiest = -1;
+        uint32_t most = 0;
+        for (size_t peer = 0; peer < _cpus.size(); peer++) {
+            uint32_t prio = _cpus[peer].best.load(std::memory_order_relaxed);
+            uint32_t size = _cpus[peer].size.load(std::memory_order_relaxed);
+            if ((int) peer != cpu && prio <= global + _tolerance && size > most) {
+                busiest = peer;
+                most = size;
+            }
+        }
+        if (busiest == -1) {
+            continue;    // The best one was taken meanwhile
+        }
+        std::shared_ptr<pcb_t> proc = pop(_cpus[busiest]);
+        if (proc) {
+            mine.steals += 1;
+            return proc;
+        }
+    }
+}
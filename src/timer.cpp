@@ -1,7 +1,24 @@
 
 #include "timer.h"
-
-static pthread_t _timer;
+#include "trace.h"
+
+#include <atomic>
+#include <climits>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Spins of a device waiting for the next slot before it sleeps on the
+ * futex. On a single CPU the device holding up the slot cannot run
+ * meanwhile, so devices sleep at once there */
+#define BARRIER_SPINS 4000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
 
 struct timer_id_container_t {
 	struct timer_id_t id;
@@ -10,84 +27,154 @@ struct timer_id_container_t {
 
 static struct timer_id_container_t * dev_list = nullptr;
 
-static uint64_t _time;
+static std::atomic<uint64_t> _time;
 
 static int timer_started = 0;
-static int timer_stop = 0;
-
-
-static void * timer_routine(void * args) {
-	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
-		/* Wait for all devices have done the job in current
-		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != nullptr; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
-		}
+static int timer_fast = 0;
+static int timer_skip = 0;
+static int timer_verbose = 1;
+static uint64_t quantum = 1;
+static tick_handler_t tick_handler = nullptr;
+static uint64_t handler_wake = NO_WAKE;    // Returned by the last tick_handler call
+static int spins = 0;
+
+/*
+ * Sense-reversing barrier. [gate] packs the devices taking part, attached
+ * and not detached yet, in its high half and the ones done with the
+ * current slot in its low half. The device completing the count, by
+ * arriving or by detaching, starts the next slot for everybody: it resets
+ * the count and flips [sense], which the others wait on. [wake] is the
+ * earliest slot in which a device done with the current one has work
+ */
+static struct {
+	alignas(64) std::atomic<uint64_t> gate{};
+	std::atomic<uint64_t> wake{NO_WAKE};
+	alignas(64) std::atomic<uint32_t> sense{};
+	std::atomic<uint32_t> sleepers{};
+} barrier;
+
+#define GATE_DEVICE (1ULL << 32)
+#define GATE_ARRIVED(gate) ((gate) & 0xffffffffULL)
+#define GATE_DEVICES(gate) ((gate) >> 32)
+
+static long futex(std::atomic<uint32_t> * word, int op, uint32_t value) {
+	return syscall(SYS_futex, (uint32_t *) word, op | FUTEX_PRIVATE_FLAG, value, nullptr, nullptr, 0);
+}
 
-		/* Increase the time slot */
-		_time++;
-		
-		/* Let devices continue their job */
-		for (temp = dev_list; temp != nullptr; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
+/* Run by the device completing the slot while every other one waits */
+static void tick(uint64_t devices) {
+	uint64_t wake = std::min(barrier.wake.exchange(NO_WAKE, std::memory_order_relaxed), handler_wake);
+	/* Increase the time slot. Nothing happens before the quantum holding
+	 * [wake] when every device is idle, go there at once */
+	uint64_t now = _time.load(std::memory_order_relaxed);
+	uint64_t next = now + quantum;
+	if (timer_skip && wake != NO_WAKE && wake > next) {
+		next = wake / quantum * quantum;
+	}
+	/* Slots up to the end of the current quantum are printed already */
+	if (devices > 0 && timer_verbose) {
+		for (uint64_t slot = now + quantum; slot < next + quantum; slot++) {
+			trace_record(TRACE_SLOT, slot, 0, 0);
 		}
-		if (fsh == event) {
-			break;
+	}
+	_time.store(next, std::memory_order_relaxed);
+	if (devices > 0) {
+		/* Without devices the run is over, trace_close() prints the rest */
+		trace_flush(next);
+		if (tick_handler != nullptr) {
+			handler_wake = tick_handler(next);
 		}
 	}
-	pthread_exit(args);
+	barrier.gate.store(devices * GATE_DEVICE, std::memory_order_relaxed);
+
+	/* Let devices continue their job */
+	barrier.sense.fetch_add(1, std::memory_order_seq_cst);
+	if (barrier.sleepers.load(std::memory_order_seq_cst) > 0) {
+		futex(&barrier.sense, FUTEX_WAKE, INT_MAX);
+	}
 }
 
 void next_slot(struct timer_id_t * timer_id) {
+	idle_slot(timer_id, 0);
+}
+
+uint64_t idle_slot(struct timer_id_t * timer_id, uint64_t until) {
+	uint64_t slot = _time.load(std::memory_order_relaxed);
+	uint64_t wake = barrier.wake.load(std::memory_order_relaxed);
+	while (until < wake && !barrier.wake.compare_exchange_weak(wake, until, std::memory_order_relaxed)) {
+	}
+
 	/* Tell to timer that we have done our job in current slot */
-	pthread_mutex_lock(&timer_id->event_lock);
-	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
-
-	/* Wait for going to next slot */
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+	timer_id->sense ^= 1;
+	uint64_t gate = barrier.gate.fetch_add(1, std::memory_order_acq_rel) + 1;
+	if (GATE_ARRIVED(gate) == GATE_DEVICES(gate)) {
+		tick(GATE_DEVICES(gate));
+		return _time.load(std::memory_order_relaxed) - slot;
+	}
+
+	/* Wait for going to next slot, spinning first as it is usually short */
+	for (int i = 0; i < spins; i++) {
+		if ((barrier.sense.load(std::memory_order_acquire) & 1) == timer_id->sense) {
+			return _time.load(std::memory_order_relaxed) - slot;
+		}
+		cpu_relax();
+	}
+	barrier.sleepers.fetch_add(1, std::memory_order_seq_cst);
+	uint32_t sense;
+	while (((sense = barrier.sense.load(std::memory_order_seq_cst)) & 1) != timer_id->sense) {
+		futex(&barrier.sense, FUTEX_WAIT, sense);
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+	barrier.sleepers.fetch_sub(1, std::memory_order_relaxed);
+	return _time.load(std::memory_order_relaxed) - slot;
 }
 
 uint64_t current_time() {
-	return _time;
+	return _time.load(std::memory_order_relaxed);
+}
+
+void set_fast_timer(int fast) {
+	timer_fast = fast;
+}
+
+int fast_timer() {
+	return timer_fast;
+}
+
+void set_skip_idle(int skip) {
+	timer_skip = skip;
+}
+
+void set_tick_handler(tick_handler_t handler) {
+	tick_handler = handler;
+}
+
+void set_timer_quantum(uint32_t slots) {
+	quantum = slots;
+}
+
+void set_timer_verbose(int verbose) {
+	timer_verbose = verbose;
 }
 
 void start_timer() {
 	timer_started = 1;
-	pthread_create(&_timer, nullptr, timer_routine, nullptr);
+	_time.store(0, std::memory_order_relaxed);
+	spins = std::thread::hardware_concurrency() > 1 ? BARRIER_SPINS : 0;
+	if (timer_verbose) {
+		for (uint64_t slot = 0; slot < quantum; slot++) {
+			trace_record(TRACE_SLOT, slot, 0, 0);
+		}
+	}
+	handler_wake = tick_handler != nullptr ? tick_handler(0) : NO_WAKE;
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+	/* The slot may only be waiting for this device */
+	uint64_t gate = barrier.gate.fetch_sub(GATE_DEVICE, std::memory_order_acq_rel) - GATE_DEVICE;
+	if (GATE_ARRIVED(gate) == GATE_DEVICES(gate)) {
+		tick(GATE_DEVICES(gate));
+	}
 }
 
 struct timer_id_t * attach_event() {
@@ -96,14 +183,11 @@ struct timer_id_t * attach_event() {
 	}else{
 		auto * container =
 			(struct timer_id_container_t*)malloc(
-				sizeof(struct timer_id_container_t)		
+				sizeof(struct timer_id_container_t)
 			);
-		container->id.done = 0;
 		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, nullptr);
-		pthread_mutex_init(&container->id.event_lock, nullptr);
-		pthread_cond_init(&container->id.timer_cond, nullptr);
-		pthread_mutex_init(&container->id.timer_lock, nullptr);
+		container->id.sense = barrier.sense.load(std::memory_order_relaxed) & 1;
+		barrier.gate.fetch_add(GATE_DEVICE, std::memory_order_relaxed);
 		if (dev_list == nullptr) {
 			dev_list = container;
 			dev_list->next = nullptr;
@@ -116,19 +200,11 @@ struct timer_id_t * attach_event() {
 }
 
 void stop_timer() {
-	timer_stop = 1;
-	pthread_join(_timer, nullptr);
+	/* Ready for new devices */
+	timer_started = 0;
 	while (dev_list != nullptr) {
 		struct timer_id_container_t * temp = dev_list;
 		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
 		free(temp);
 	}
 }
-
-
-
-
@@ -0,0 +1,245 @@
+
+#include "trace.h"
+
+/* Events of one thread. Only the thread appends to it and only the
+ * writer takes events out, so the two indices need no lock */
+struct trace_ring_t {
+    trace_event_t events[TRACE_RING_SIZE];
+    alignas(64) std::atomic<uint64_t> head{};    // Next event to write out
+    alignas(64) std::atomic<uint64_t> tail{};    // Next event to append
+};
+
+static FILE *trace_file = nullptr;
+static std::thread writer;
+static std::atomic<bool> stopping{false};
+
+/* Printed events of one thread waiting for trace_flush(), see
+ * trace_hold(). Only the thread appends to it, and trace_flush() only
+ * takes events out while every other thread recording events waits for
+ * the next slot, so it needs no lock */
+struct trace_held_t {
+    std::vector<trace_event_t> events;
+};
+
+/* Guards rings, helds and names, only taken by a thread's first event, by
+ * a named event, by the writer and once per trace_flush() */
+static std::mutex trace_lock;
+static std::vector<std::unique_ptr<trace_ring_t>> rings;
+static std::vector<std::unique_ptr<trace_held_t>> helds;
+static std::map<std::string, uint32_t> names;
+static std::vector<const std::string *> name_list;    // By index
+static std::vector<std::string> new_names;    // Not in the file yet
+
+static thread_local trace_ring_t *own_ring = nullptr;
+static thread_local trace_held_t *own_held = nullptr;
+
+static bool holding = false;
+static std::vector<trace_event_t> merged;    // Only used by print_held()
+
+void trace_print(FILE *out, const trace_event_t &event, const char *name) {
+    switch (event.type) {
+        case TRACE_SLOT:
+            fprintf(out, "Time slot %3lu\n", event.time);
+            break;
+        case TRACE_LOAD:
+            fprintf(out, "\tLoaded a process at %s, PID: %d PRIO: %d\n", name, event.pid, event.arg);
+            break;
+        case TRACE_FORK:
+            fprintf(out, "\tForked a process, PID: %d\n", event.pid);
+            break;
+        case TRACE_DISPATCH:
+            fprintf(out, "\tCPU %d: Dispatched process %2d\n", event.cpu, event.pid);
+            break;
+        case TRACE_PUT:
+            fprintf(out, "\tCPU %d: Put process %2d to run queue\n", event.cpu, event.pid);
+            break;
+        case TRACE_FINISH:
+            fprintf(out, "\tCPU %d: Processed %2d has finished\n", event.cpu, event.pid);
+            break;
+        case TRACE_STOP:
+            fprintf(out, "\tCPU %d stopped\n", event.cpu);
+            break;
+        default:
+            break;
+    }
+}
+
+static int phase(const trace_event_t &event) {
+    switch (event.type) {
+        case TRACE_SLOT:
+            return 0;
+        case TRACE_LOAD:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+bool trace_before(const trace_event_t &a, const trace_event_t &b) {
+    return a.time != b.time ? a.time < b.time : phase(a) < phase(b);
+}
+
+void trace_hold() {
+    holding = true;
+}
+
+/* Merge the held events of the slots before [time] from every thread
+ * and print them, the slot lines only up to [last] */
+static void print_held(uint64_t time, uint64_t last) {
+    std::unique_lock<std::mutex> lock(trace_lock);
+    merged.clear();
+    for (const auto &held: helds) {
+        size_t kept = 0;
+        for (const trace_event_t &event: held->events) {
+            if (event.time < time) {
+                merged.push_back(event);
+            } else {
+                held->events[kept++] = event;
+            }
+        }
+        held->events.resize(kept);
+    }
+    std::stable_sort(merged.begin(), merged.end(), trace_before);
+    for (const trace_event_t &event: merged) {
+        if (event.type != TRACE_SLOT || event.time <= last) {
+            trace_print(stdout, event, event.type == TRACE_LOAD ? name_list[event.name]->c_str() : "");
+        }
+    }
+}
+
+/* Index of [name], written to the file on its first use */
+static uint32_t name_index(const char *name) {
+    std::unique_lock<std::mutex> lock(trace_lock);
+    auto known = names.emplace(name, names.size());
+    if (known.second) {
+        name_list.push_back(&known.first->first);
+        if (trace_file != nullptr) {
+            new_names.emplace_back(name);
+        }
+    }
+    return known.first->second;
+}
+
+void trace_flush(uint64_t time) {
+    if (holding) {
+        print_held(time, UINT64_MAX);
+    }
+}
+
+/* Save the events appended since the last call and the new names,
+ * return the number of events */
+static uint64_t drain() {
+    std::vector<trace_ring_t *> all;
+    std::vector<std::string> fresh;
+    {
+        std::unique_lock<std::mutex> lock(trace_lock);
+        for (const auto &ring: rings) {
+            all.push_back(ring.get());
+        }
+        fresh.swap(new_names);
+    }
+    uint64_t drained = 0;
+    for (trace_ring_t *ring: all) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        while (head < tail) {
+            /* Up to the end of the array, then from its start */
+            uint64_t index = head % TRACE_RING_SIZE;
+            uint64_t count = std::min(tail - head, TRACE_RING_SIZE - index);
+            fwrite(&ring->events[index], sizeof(trace_event_t), count, trace_file);
+            head += count;
+            drained += count;
+        }
+        ring->head.store(head, std::memory_order_release);
+    }
+    for (const std::string &name: fresh) {
+        trace_event_t record{};
+        record.type = TRACE_NAME;
+        {
+            std::unique_lock<std::mutex> lock(trace_lock);
+            record.pid = names[name];
+        }
+        record.arg = name.size();
+        fwrite(&record, sizeof(record), 1, trace_file);
+        fwrite(name.data(), 1, name.size(), trace_file);
+    }
+    return drained;
+}
+
+static void writer_routine() {
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (drain() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    drain();
+}
+
+void trace_open(const char *path) {
+    if ((trace_file = fopen(path, "wb")) == nullptr) {
+        printf("Cannot open trace file %s\n", path);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    stopping = false;
+    writer = std::thread(writer_routine);
+}
+
+void trace_close() {
+    if (trace_file == nullptr) {
+        if (holding) {
+            uint64_t last = 0;
+            for (const auto &held: helds) {
+                for (const trace_event_t &event: held->events) {
+                    if (event.type != TRACE_SLOT) {
+                        last = std::max(last, event.time);
+                    }
+                }
+            }
+            print_held(UINT64_MAX, last);
+            holding = false;
+        }
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    fclose(trace_file);
+    trace_file = nullptr;
+}
+
+void trace_record(trace_type_t type, uint64_t time, int cpu, uint32_t pid, uint32_t arg, const char *name) {
+    trace_event_t event{};
+    event.time = time;
+    event.type = type;
+    event.cpu = cpu;
+    event.pid = pid;
+    event.arg = arg;
+    if (trace_file == nullptr && !holding) {
+        trace_print(stdout, event, name);
+        return;
+    }
+    if (name != nullptr) {
+        event.name = name_index(name);
+    }
+    if (trace_file == nullptr) {
+        if (own_held == nullptr) {
+            std::unique_lock<std::mutex> lock(trace_lock);
+            helds.push_back(std::make_unique<trace_held_t>());
+            own_held = helds.back().get();
+        }
+        own_held->events.push_back(event);
+        return;
+    }
+    if (own_ring == nullptr) {
+        std::unique_lock<std::mutex> lock(trace_lock);
+        rings.push_back(std::make_unique<trace_ring_t>());
+        own_ring = rings.back().get();
+    }
+    uint64_t tail = own_ring->tail.load(std::memory_order_relaxed);
+    /* Full, wait for the writer to catch up */
+    while (tail - own_ring->head.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+        std::this_thread::yield();
+    }
+    own_ring->events[tail % TRACE_RING_SIZE] = event;
+    own_ring->tail.store(tail + 1, std::memory_order_release);
+}
@@ -0,0 +1,58 @@
+
+#include "trace.h"
+
+/* Print a trace file saved by os with trace=<path> as the lines os prints
+ * without one. Threads save their events independently, they are put
+ * back in order by slot: the slot line first, then the arrivals, which
+ * the timer admits before any CPU runs, then the events of the CPUs in
+ * the order each CPU recorded them */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("Usage: tracedump [path to trace file]\n");
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == nullptr) {
+        printf("Cannot open trace file %s\n", argv[1]);
+        return 1;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        printf("Not a trace file: %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<trace_event_t> events;
+    std::map<uint32_t, std::string> names;
+    trace_event_t event{};
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type != TRACE_NAME) {
+            events.push_back(event);
+            continue;
+        }
+        std::string name(event.arg, '\0');
+        if (fread(name.data(), 1, name.size(), file) != name.size()) {
+            printf("Truncated trace file: %s\n", argv[1]);
+            return 1;
+        }
+        names[event.pid] = name;
+    }
+    fclose(file);
+
+    std::stable_sort(events.begin(), events.end(), trace_before);
+    /* Slot lines past the last event come from a quantum run to its end */
+    uint64_t last = 0;
+    for (const trace_event_t &it: events) {
+        if (it.type != TRACE_SLOT) {
+            last = std::max(last, it.time);
+        }
+    }
+    for (const trace_event_t &it: events) {
+        if (it.type == TRACE_SLOT && it.time > last) {
+            continue;
+        }
+        trace_print(stdout, it, it.type == TRACE_LOAD ? names[it.name].c_str() : nullptr);
+    }
+    return 0;
+}